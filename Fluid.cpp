@@ -0,0 +1,1341 @@
+#include "Fluid.h"
+
+#include <cmath>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/** Memory-mapped checkpoints */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Namespace */
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// Configuration
+//-----------------------------------------------------------------------------
+
+float FluidConfig::cellSize() const
+{
+	return std::max(cell_size, cutoff + skin);
+}
+
+glm::ivec3 FluidConfig::gridDim() const
+{
+	return glm::max(glm::ivec3(glm::ceil((bb_max - bb_min) / cellSize())), glm::ivec3(1));
+}
+
+unsigned int FluidConfig::numCells() const
+{
+	if (hash_size) return hash_size;
+
+	glm::ivec3 grid_dim = gridDim();
+	return grid_dim.x * grid_dim.y * grid_dim.z;
+}
+
+// float literal for OpenCL C, keeps the decimal point so it is never parsed as int or double
+static string clFloat(float value)
+{
+	ostringstream outs;
+	outs << showpoint << value << "f";
+	return outs.str();
+}
+
+string FluidConfig::buildOptions() const
+{
+	ostringstream outs;
+	outs
+		<< " -DBB_MIN_X=" << clFloat(bb_min.x)
+		<< " -DBB_MIN_Y=" << clFloat(bb_min.y)
+		<< " -DBB_MIN_Z=" << clFloat(bb_min.z)
+		<< " -DBB_MAX_X=" << clFloat(bb_max.x)
+		<< " -DBB_MAX_Y=" << clFloat(bb_max.y)
+		<< " -DBB_MAX_Z=" << clFloat(bb_max.z)
+		<< " -DCELL_SIZE=" << clFloat(cellSize())
+		<< " -DGRAVITY=" << clFloat(gravity)
+		<< " -DDENSITY=" << clFloat(density)
+		<< " -DMASS=" << clFloat(mass)
+		<< " -DCUTOFF=" << clFloat(cutoff)
+		<< " -DSKIN=" << clFloat(skin)
+		<< " -DMAX_NEIGHBORS=" << max_neighbors;
+
+	if (hash_size) {
+		outs << " -DHASH_GRID -DHASH_TABLE_SIZE=" << hash_size;
+	}
+	else {
+		glm::ivec3 grid_dim = gridDim();
+		outs
+			<< " -DGRID_DIM_X=" << grid_dim.x
+			<< " -DGRID_DIM_Y=" << grid_dim.y
+			<< " -DGRID_DIM_Z=" << grid_dim.z;
+	}
+
+	return outs.str();
+}
+
+bool loadScene(const char* filename, FluidConfig & config)
+{
+	ifstream scene_file(filename, std::ios::in);
+	if (!scene_file) { cerr << "Cannot open scene file: " << filename << "\n"; return false; }
+
+	string line;
+	while (getline(scene_file, line)) {
+
+		istringstream ins(line);
+		string key;
+		if (!(ins >> key) || key[0] == '#') continue;
+
+		if (key == "particles")
+			ins >> config.num_particles;
+		else if (key == "bounds")
+			ins >> config.bb_min.x >> config.bb_min.y >> config.bb_min.z
+				>> config.bb_max.x >> config.bb_max.y >> config.bb_max.z;
+		else if (key == "cell")
+			ins >> config.cell_size;
+		else if (key == "hash")
+			ins >> config.hash_size;
+		else if (key == "dispatch") {
+			string mode;
+			ins >> mode;
+			config.cell_dispatch = (mode == "cell");
+		}
+		else if (key == "skin")
+			ins >> config.skin;
+		else if (key == "neighbors")
+			ins >> config.max_neighbors;
+		else if (key == "reorder")
+			ins >> config.reorder_interval;
+		else if (key == "fused")
+			ins >> config.fused;
+		else if (key == "backend") {
+			string backend;
+			ins >> backend;
+			config.native = (backend == "native");
+		}
+		else if (key == "threads")
+			ins >> config.threads;
+		else if (key == "dt")
+			ins >> config.delta_time;
+		else if (key == "substeps")
+			ins >> config.max_substeps;
+		else if (key == "gravity")
+			ins >> config.gravity;
+		else if (key == "density")
+			ins >> config.density;
+		else if (key == "mass")
+			ins >> config.mass;
+		else if (key == "cutoff")
+			ins >> config.cutoff;
+		else
+			cerr << "Unknown scene entry: " << key << "\n";
+
+		if (ins.fail()) { cerr << "Bad scene entry: " << line << "\n"; return false; }
+	}
+
+	return true;
+}
+
+int parseArgs(int argc, char* argv[], FluidConfig & config)
+{
+	int i = 1;
+	for (; i < argc; i++) {
+
+		string arg = argv[i];
+
+		if (arg == "--scene" && i + 1 < argc) {
+			if (!loadScene(argv[++i], config)) exit(1);
+		}
+		else if (arg == "-n" && i + 1 < argc) {
+			config.num_particles = stoul(argv[++i]);
+		}
+		else if (arg == "--bounds" && i + 6 < argc) {
+			config.bb_min = glm::vec3(stof(argv[i + 1]), stof(argv[i + 2]), stof(argv[i + 3]));
+			config.bb_max = glm::vec3(stof(argv[i + 4]), stof(argv[i + 5]), stof(argv[i + 6]));
+			i += 6;
+		}
+		else if (arg == "--cell" && i + 1 < argc) {
+			config.cell_size = stof(argv[++i]);
+		}
+		else if (arg == "--hash" && i + 1 < argc) {
+			config.hash_size = stoul(argv[++i]);
+		}
+		else if (arg == "--cell-dispatch") {
+			config.cell_dispatch = true;
+		}
+		else if (arg == "--skin" && i + 1 < argc) {
+			config.skin = stof(argv[++i]);
+		}
+		else if (arg == "--neighbors" && i + 1 < argc) {
+			config.max_neighbors = stoul(argv[++i]);
+		}
+		else if (arg == "--reorder" && i + 1 < argc) {
+			config.reorder_interval = stoul(argv[++i]);
+		}
+		else if (arg == "--fused") {
+			config.fused = true;
+		}
+		else if (arg == "--no-tune") {
+			config.tuned = false;
+		}
+		else if (arg == "--backend" && i + 1 < argc) {
+			config.native = (string(argv[++i]) == "native");
+		}
+		else if (arg == "--threads" && i + 1 < argc) {
+			config.threads = stoul(argv[++i]);
+		}
+		else if (arg == "--dt" && i + 1 < argc) {
+			config.delta_time = stof(argv[++i]);
+		}
+		else if (arg == "--substeps" && i + 1 < argc) {
+			config.max_substeps = stoul(argv[++i]);
+		}
+		else if (arg == "--resume" && i + 1 < argc) {
+			if (!loadCheckpointConfig(argv[++i], config)) exit(1);
+		}
+		else break;
+	}
+
+	if (config.num_particles == 0 || config.cutoff <= 0.0f || config.delta_time <= 0.0f ||
+		config.skin < 0.0f || config.max_neighbors == 0 || config.max_substeps == 0 ||
+		glm::any(glm::lessThanEqual(config.bb_max, config.bb_min))) {
+		cerr << "Invalid fluid configuration\n";
+		exit(1);
+	}
+
+	if (config.cell_dispatch && config.hash_size) {
+		cerr << "Cell-centric dispatch needs a dense grid, solving per particle\n";
+		config.cell_dispatch = false;
+	}
+
+	if (config.cell_dispatch && config.skin > 0.0f) {
+		cerr << "Cell-centric dispatch ignored, solving over neighbor lists\n";
+		config.cell_dispatch = false;
+	}
+
+	// Z-order keys keep 10 bits of each cell coordinate, wider grids would alias
+	if (config.reorder_interval && glm::any(glm::greaterThan(config.gridDim(), glm::ivec3(1024)))) {
+		cerr << "Reordering needs at most 1024 cells per axis, particles stay in their order\n";
+		config.reorder_interval = 0;
+	}
+
+	return i;
+}
+
+//-----------------------------------------------------------------------------
+// Fluid
+//-----------------------------------------------------------------------------
+
+Fluid::Fluid(CLInfo & clInfo, const FluidConfig & config) :
+	Solver(config),
+	clInfo(clInfo)
+{
+	profiler.enabled = (clInfo.queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) != 0;
+
+	// Create program for kernels
+	// Particle.cl includes ParticleLayout.h from the working directory
+	std::string options = "-I. " + config.buildOptions();
+	buildProgram(clInfo, "Particle.cl", program, options.c_str());
+	buildKernels();
+	if (config.tuned) loadTuning();
+
+	// Create buffer for GPU
+	initBuffers();
+}
+
+//-----------------------------------------------------------------------------
+// Create kernels from the program
+//-----------------------------------------------------------------------------
+
+// in KernelId order. Tunable kernels run at any work-group size; the others size local
+// memory or their dispatch by it (scan, cell-centric solve) or run a single work item
+const Fluid::KernelInfo Fluid::kernel_info[] = {
+	{ "kernel_externel_force", STAGE_FORCE, true },
+	{ "kernel_find_cell", STAGE_FIND_CELL, true },
+	{ "kernel_calc_lambda", STAGE_LAMBDA, true },
+	{ "kernel_calc_disp", STAGE_DISPLACEMENT, true },
+	{ "kernel_update", STAGE_UPDATE, true },
+	{ "kernel_viscosity", STAGE_VISCOSITY, false },
+	{ "kernel_reset_cell", STAGE_BINNING, true },
+	{ "kernel_count_cell", STAGE_BINNING, true },
+	{ "kernel_scan_cell", STAGE_BINNING, false },
+	{ "kernel_sort_cell", STAGE_BINNING, true },
+	{ "kernel_calc_lambda_cell", STAGE_LAMBDA, false },
+	{ "kernel_calc_disp_cell", STAGE_DISPLACEMENT, false },
+	{ "kernel_check_skin", STAGE_NEIGHBORS, true },
+	{ "kernel_build_neighbors", STAGE_NEIGHBORS, true },
+	{ "kernel_clear_rebuild", STAGE_NEIGHBORS, false },
+	{ "kernel_calc_lambda_list", STAGE_LAMBDA, true },
+	{ "kernel_calc_disp_list", STAGE_DISPLACEMENT, true },
+	{ "kernel_morton_key", STAGE_REORDER, true },
+	{ "kernel_bitonic_sort", STAGE_REORDER, true },
+	{ "kernel_reorder", STAGE_REORDER, true },
+	{ "kernel_fill_instances", STAGE_INSTANCES, true },
+	{ "kernel_predict_cell", STAGE_FORCE_BINNING, true },
+	{ "kernel_calc_disp_update", STAGE_DISPLACEMENT_UPDATE, true },
+	{ "kernel_sum_cell_blocks", STAGE_BINNING, false },
+	{ "kernel_scan_cell_blocks", STAGE_BINNING, false },
+};
+
+void Fluid::buildKernels()
+{
+	static_assert(sizeof(kernel_info) / sizeof(kernel_info[0]) == NUM_KERNELS, "one kernel_info entry per kernel");
+
+	// Specify OpenCL kernel arguments (args[0] here is entry function name of GPU)
+	for (unsigned int k = 0; k < NUM_KERNELS; k++)
+		buildKernel(clInfo, program, kernel_info[k].name, kernels[k]);
+
+	// query work-group sizes once, not on every launch
+	for (unsigned int k = 0; k < NUM_KERNELS; k++)
+		group_sizes[k] = kernels[k].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clInfo.device);
+
+	// the three scan kernels share one block size
+	scan_size = std::min(group_sizes[KERNEL_SCAN_CELL], std::min(group_sizes[KERNEL_SUM_CELL_BLOCKS], group_sizes[KERNEL_SCAN_CELL_BLOCKS]));
+
+	// cells hold tens of particles, small work-groups keep most work items busy
+	cell_group_size = std::min<std::size_t>(64, std::min(group_sizes[KERNEL_LAMBDA_CELL], group_sizes[KERNEL_DISP_CELL]));
+
+	// stage up to 2048 neighbors, within half the local memory
+	cell_capacity = (unsigned int) std::min<cl_ulong>(2048,
+		clInfo.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2 / sizeof(cl_float4));
+}
+
+//-----------------------------------------------------------------------------
+// Allocate device buffers and bind them to kernels
+//-----------------------------------------------------------------------------
+
+void Fluid::initBuffers()
+{
+	unsigned int cnt_obj = config.num_particles;
+	unsigned int cnt_cell = config.numCells();
+
+	// Round up to a whole number of the largest work-group, so no rounded-up
+	// global work size in runKernel can index past the end of a buffer
+	std::size_t group = clInfo.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	num_padded = (cnt_obj + group - 1) / group * group;
+
+	positions.assign(cnt_obj, glm::vec4(0.0f));
+	prev_positions.assign(cnt_obj, glm::vec4(0.0f));
+	velocities.assign(cnt_obj, glm::vec4(0.0f));
+
+	clPositions = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * PARTICLE_FIELD_SIZE);
+	clPrevPositions = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * PARTICLE_FIELD_SIZE);
+	clVelocities = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * PARTICLE_FIELD_SIZE);
+	clPredicted = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * PARTICLE_FIELD_SIZE);
+	clIndices = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * sizeof(int));
+	clLookup = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, cnt_cell * sizeof(Lookup_t));
+	clLambdas = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * sizeof(float));
+	clCellIds = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * sizeof(int));
+	clRanks = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * sizeof(int));
+	clOccupied = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, std::min<std::size_t>(cnt_cell, num_padded) * sizeof(int));
+	clNumOccupied = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, sizeof(int));
+	num_scan_blocks = (cnt_cell + scan_size - 1) / scan_size;
+	clBlockSums = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_scan_blocks * sizeof(cl_int2));
+
+	// neighbor lists only take memory when enabled
+	std::size_t list_size = config.skin > 0.0f ? num_padded : 1;
+	clNeighbors = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, list_size * config.max_neighbors * sizeof(int));
+	clNeighborCounts = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, list_size * sizeof(int));
+	clListPos = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, list_size * sizeof(cl_float4));
+	clRebuild = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, sizeof(int));
+	clNeighborPeak = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, sizeof(int));
+
+	// lists are built on the first step
+	int rebuild = 1;
+	clInfo.queue.enqueueWriteBuffer(clRebuild, CL_TRUE, 0, sizeof(int), &rebuild);
+	clInfo.queue.enqueueFillBuffer(clNeighborPeak, (cl_int) 0, 0, sizeof(cl_int));
+
+	// bitonic sort runs over a power of two keys; gather targets only exist when reordering
+	num_sorted = 1;
+	while (num_sorted < cnt_obj) num_sorted <<= 1;
+	std::size_t sorted_size = config.reorder_interval ? num_sorted : 1;
+	std::size_t gather_size = config.reorder_interval ? num_padded : 1;
+	clIds = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, num_padded * sizeof(int));
+	clSortKeys = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, sorted_size * sizeof(cl_uint));
+	clSortOrder = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, sorted_size * sizeof(int));
+	clPositionsSorted = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, gather_size * PARTICLE_FIELD_SIZE);
+	clVelocitiesSorted = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, gather_size * PARTICLE_FIELD_SIZE);
+	clPredictedSorted = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, gather_size * PARTICLE_FIELD_SIZE);
+	clLambdasSorted = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, gather_size * sizeof(float));
+	clIdsSorted = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, gather_size * sizeof(int));
+
+	bindBuffers();
+}
+
+//-----------------------------------------------------------------------------
+// Bind buffers to kernel arguments, again whenever a buffer is replaced
+//-----------------------------------------------------------------------------
+
+void Fluid::bindBuffers()
+{
+	unsigned int cnt_obj = config.num_particles;
+	unsigned int cnt_cell = config.numCells();
+
+	//
+	kernels[KERNEL_FORCE].setArg(0, clPositions);
+	kernels[KERNEL_FORCE].setArg(1, clVelocities);
+	kernels[KERNEL_FORCE].setArg(2, clPredicted);
+	kernels[KERNEL_FORCE].setArg(4, cnt_obj);
+	//
+	kernels[KERNEL_FIND_CELL].setArg(0, clPredicted);
+	kernels[KERNEL_FIND_CELL].setArg(1, clCellIds);
+	kernels[KERNEL_FIND_CELL].setArg(2, cnt_obj);
+	//
+	kernels[KERNEL_LAMBDA].setArg(0, clPredicted);
+	kernels[KERNEL_LAMBDA].setArg(1, clLookup);
+	kernels[KERNEL_LAMBDA].setArg(2, clIndices);
+	kernels[KERNEL_LAMBDA].setArg(3, clLambdas);
+	kernels[KERNEL_LAMBDA].setArg(4, cnt_obj);
+	//
+	kernels[KERNEL_DISP].setArg(0, clPredicted);
+	kernels[KERNEL_DISP].setArg(1, clLookup);
+	kernels[KERNEL_DISP].setArg(2, clIndices);
+	kernels[KERNEL_DISP].setArg(3, clLambdas);
+	kernels[KERNEL_DISP].setArg(4, cnt_obj);
+	//
+	kernels[KERNEL_UPDATE].setArg(0, clPositions);
+	kernels[KERNEL_UPDATE].setArg(1, clVelocities);
+	kernels[KERNEL_UPDATE].setArg(2, clPredicted);
+	kernels[KERNEL_UPDATE].setArg(3, clPrevPositions);
+	kernels[KERNEL_UPDATE].setArg(5, cnt_obj);
+	//
+	//kernels[KERNEL_VISCOSITY].setArg(0, clVelocities);
+	//kernels[KERNEL_VISCOSITY].setArg(1, clPredicted);
+	//kernels[KERNEL_VISCOSITY].setArg(2, clLookup);
+	//kernels[KERNEL_VISCOSITY].setArg(3, clIndices);
+	//kernels[KERNEL_VISCOSITY].setArg(4, cnt_obj);
+	//
+	kernels[KERNEL_RESET_CELL].setArg(0, clLookup);
+	kernels[KERNEL_RESET_CELL].setArg(1, cnt_cell);
+	//
+	kernels[KERNEL_COUNT_CELL].setArg(0, clCellIds);
+	kernels[KERNEL_COUNT_CELL].setArg(1, clLookup);
+	kernels[KERNEL_COUNT_CELL].setArg(2, clRanks);
+	kernels[KERNEL_COUNT_CELL].setArg(3, cnt_obj);
+	//
+	kernels[KERNEL_SCAN_CELL].setArg(0, clLookup);
+	kernels[KERNEL_SCAN_CELL].setArg(1, clBlockSums);
+	kernels[KERNEL_SCAN_CELL].setArg(2, clOccupied);
+	kernels[KERNEL_SCAN_CELL].setArg(3, cl::Local(scan_size * sizeof(cl_int2)));
+	kernels[KERNEL_SCAN_CELL].setArg(4, cnt_cell);
+	//
+	kernels[KERNEL_SORT_CELL].setArg(0, clCellIds);
+	kernels[KERNEL_SORT_CELL].setArg(1, clRanks);
+	kernels[KERNEL_SORT_CELL].setArg(2, clLookup);
+	kernels[KERNEL_SORT_CELL].setArg(3, clIndices);
+	kernels[KERNEL_SORT_CELL].setArg(4, cnt_obj);
+	//
+	kernels[KERNEL_LAMBDA_CELL].setArg(0, clPredicted);
+	kernels[KERNEL_LAMBDA_CELL].setArg(1, clLookup);
+	kernels[KERNEL_LAMBDA_CELL].setArg(2, clIndices);
+	kernels[KERNEL_LAMBDA_CELL].setArg(3, clOccupied);
+	kernels[KERNEL_LAMBDA_CELL].setArg(4, clNumOccupied);
+	kernels[KERNEL_LAMBDA_CELL].setArg(5, clLambdas);
+	kernels[KERNEL_LAMBDA_CELL].setArg(6, cl::Local(cell_capacity * sizeof(cl_float4)));
+	kernels[KERNEL_LAMBDA_CELL].setArg(7, cell_capacity);
+	//
+	kernels[KERNEL_DISP_CELL].setArg(0, clPredicted);
+	kernels[KERNEL_DISP_CELL].setArg(1, clLookup);
+	kernels[KERNEL_DISP_CELL].setArg(2, clIndices);
+	kernels[KERNEL_DISP_CELL].setArg(3, clOccupied);
+	kernels[KERNEL_DISP_CELL].setArg(4, clNumOccupied);
+	kernels[KERNEL_DISP_CELL].setArg(5, clLambdas);
+	kernels[KERNEL_DISP_CELL].setArg(6, cl::Local(cell_capacity * sizeof(cl_float4)));
+	kernels[KERNEL_DISP_CELL].setArg(7, cell_capacity);
+	//
+	kernels[KERNEL_CHECK_SKIN].setArg(0, clPredicted);
+	kernels[KERNEL_CHECK_SKIN].setArg(1, clListPos);
+	kernels[KERNEL_CHECK_SKIN].setArg(2, clRebuild);
+	kernels[KERNEL_CHECK_SKIN].setArg(3, cnt_obj);
+	//
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(0, clPredicted);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(1, clLookup);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(2, clIndices);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(3, clNeighbors);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(4, clNeighborCounts);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(5, clListPos);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(6, clRebuild);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(7, clNeighborPeak);
+	kernels[KERNEL_BUILD_NEIGHBORS].setArg(8, cnt_obj);
+	//
+	kernels[KERNEL_CLEAR_REBUILD].setArg(0, clRebuild);
+	//
+	kernels[KERNEL_LAMBDA_LIST].setArg(0, clPredicted);
+	kernels[KERNEL_LAMBDA_LIST].setArg(1, clNeighbors);
+	kernels[KERNEL_LAMBDA_LIST].setArg(2, clNeighborCounts);
+	kernels[KERNEL_LAMBDA_LIST].setArg(3, clLambdas);
+	kernels[KERNEL_LAMBDA_LIST].setArg(4, cnt_obj);
+	//
+	kernels[KERNEL_DISP_LIST].setArg(0, clPredicted);
+	kernels[KERNEL_DISP_LIST].setArg(1, clNeighbors);
+	kernels[KERNEL_DISP_LIST].setArg(2, clNeighborCounts);
+	kernels[KERNEL_DISP_LIST].setArg(3, clLambdas);
+	kernels[KERNEL_DISP_LIST].setArg(4, cnt_obj);
+	//
+	kernels[KERNEL_MORTON_KEY].setArg(0, clPositions);
+	kernels[KERNEL_MORTON_KEY].setArg(1, clSortKeys);
+	kernels[KERNEL_MORTON_KEY].setArg(2, clSortOrder);
+	kernels[KERNEL_MORTON_KEY].setArg(3, cnt_obj);
+	kernels[KERNEL_MORTON_KEY].setArg(4, (unsigned int) num_sorted);
+	//
+	kernels[KERNEL_BITONIC_SORT].setArg(0, clSortKeys);
+	kernels[KERNEL_BITONIC_SORT].setArg(1, clSortOrder);
+	kernels[KERNEL_BITONIC_SORT].setArg(2, (unsigned int) num_sorted);
+	//
+	kernels[KERNEL_REORDER].setArg(0, clPositions);
+	kernels[KERNEL_REORDER].setArg(1, clVelocities);
+	kernels[KERNEL_REORDER].setArg(2, clPredicted);
+	kernels[KERNEL_REORDER].setArg(3, clPositionsSorted);
+	kernels[KERNEL_REORDER].setArg(4, clVelocitiesSorted);
+	kernels[KERNEL_REORDER].setArg(5, clPredictedSorted);
+	kernels[KERNEL_REORDER].setArg(6, clLambdas);
+	kernels[KERNEL_REORDER].setArg(7, clLambdasSorted);
+	kernels[KERNEL_REORDER].setArg(8, clIds);
+	kernels[KERNEL_REORDER].setArg(9, clIdsSorted);
+	kernels[KERNEL_REORDER].setArg(10, clSortOrder);
+	kernels[KERNEL_REORDER].setArg(11, cnt_obj);
+	//
+	kernels[KERNEL_FILL_INSTANCES].setArg(0, clPositions);
+	kernels[KERNEL_FILL_INSTANCES].setArg(1, clPrevPositions);
+	kernels[KERNEL_FILL_INSTANCES].setArg(2, clVelocities);
+	kernels[KERNEL_FILL_INSTANCES].setArg(5, cnt_obj);
+	//
+	kernels[KERNEL_PREDICT_CELL].setArg(0, clPositions);
+	kernels[KERNEL_PREDICT_CELL].setArg(1, clVelocities);
+	kernels[KERNEL_PREDICT_CELL].setArg(2, clPredicted);
+	kernels[KERNEL_PREDICT_CELL].setArg(3, clCellIds);
+	kernels[KERNEL_PREDICT_CELL].setArg(5, cnt_obj);
+	//
+	kernels[KERNEL_DISP_UPDATE].setArg(0, clPredicted);
+	kernels[KERNEL_DISP_UPDATE].setArg(1, clLookup);
+	kernels[KERNEL_DISP_UPDATE].setArg(2, clIndices);
+	kernels[KERNEL_DISP_UPDATE].setArg(3, clLambdas);
+	kernels[KERNEL_DISP_UPDATE].setArg(4, clPositions);
+	kernels[KERNEL_DISP_UPDATE].setArg(5, clVelocities);
+	kernels[KERNEL_DISP_UPDATE].setArg(6, clPrevPositions);
+	kernels[KERNEL_DISP_UPDATE].setArg(8, cnt_obj);
+	//
+	kernels[KERNEL_SUM_CELL_BLOCKS].setArg(0, clLookup);
+	kernels[KERNEL_SUM_CELL_BLOCKS].setArg(1, clBlockSums);
+	kernels[KERNEL_SUM_CELL_BLOCKS].setArg(2, cl::Local(scan_size * sizeof(cl_int2)));
+	kernels[KERNEL_SUM_CELL_BLOCKS].setArg(3, cnt_cell);
+	//
+	kernels[KERNEL_SCAN_CELL_BLOCKS].setArg(0, clBlockSums);
+	kernels[KERNEL_SCAN_CELL_BLOCKS].setArg(1, clNumOccupied);
+	kernels[KERNEL_SCAN_CELL_BLOCKS].setArg(2, cl::Local(scan_size * sizeof(cl_int2)));
+	kernels[KERNEL_SCAN_CELL_BLOCKS].setArg(3, (unsigned int) num_scan_blocks);
+}
+
+Fluid::~Fluid()
+{
+	// the overflow check reads into a member
+	if (peak_pending) peak_read.wait();
+
+	// buffers backed by a checkpoint mapping must be gone before it is
+	if (checkpoint_map) {
+		clInfo.queue.finish();
+		clPositions = cl::Buffer();
+		clPrevPositions = cl::Buffer();
+		clVelocities = cl::Buffer();
+		munmap(checkpoint_map, checkpoint_map_size);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Resume from config.checkpoint when given, else stack particles in a lattice
+// column, and upload them
+//-----------------------------------------------------------------------------
+
+void Fluid::initParticles()
+{
+	restart();
+
+	if (!config.checkpoint.empty()) {
+		if (loadCheckpoint(config.checkpoint.c_str())) return;
+		cerr << "Starting from the initial lattice instead\n";
+	}
+
+	initLattice();
+	upload();
+}
+
+// shared by every backend, so that they all start from the same particles
+void Solver::initLattice()
+{
+	unsigned int cnt_obj = config.num_particles;
+
+	positions.resize(cnt_obj);
+	velocities.resize(cnt_obj);
+
+	// 10 particles per row 0.2 apart for small scenes, tighter and wider
+	// rows for large ones so that the column still fits the bound box
+	glm::vec3 extent = config.bb_max - config.bb_min;
+	glm::vec3 center = 0.5f * (config.bb_max + config.bb_min);
+	unsigned int per_row = std::max(10u, (unsigned int) std::ceil(std::cbrt(cnt_obj / 1.5f)));
+	unsigned int per_layer = per_row * per_row;
+	float spacing = std::min(0.2f, (std::min(extent.x, extent.z) - 0.2f) / per_row);
+	float origin_x = center.x - 0.5f * spacing * (per_row - 1);
+	float origin_z = center.z - 0.5f * spacing * (per_row - 1);
+
+	for (unsigned int i = 0; i < cnt_obj; i++) {
+		//float px = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
+		//float py = 0.0f;
+		//float pz = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
+		//float vx = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
+		//float vy = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
+		//float vz = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
+		float px = origin_x + spacing * (i % per_row);
+		float py = config.bb_min.y + 0.1f + spacing * (i / per_layer);
+		float pz = origin_z + spacing * ((i / per_row) % per_row);
+		float vx = 0.0f;
+		float vy = 0.0f;
+		float vz = 0.0f;
+		positions[i] = glm::vec4(px, py, pz, 0.0f);
+		velocities[i] = glm::vec4(vx, vy, vz, 0.0f);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Start over from given particles
+//-----------------------------------------------------------------------------
+
+void Fluid::setParticles(const vector<glm::vec4> & new_positions, const vector<glm::vec4> & new_velocities)
+{
+	restart();
+
+	std::copy(new_positions.begin(), new_positions.begin() + size(), positions.begin());
+	std::copy(new_velocities.begin(), new_velocities.begin() + size(), velocities.begin());
+	upload();
+}
+
+// particles back in original order, nothing pending
+void Fluid::restart()
+{
+	unsigned int cnt_obj = config.num_particles;
+
+	// a snapshot still pending is from before the reset: let its copies into ids and
+	// the back arrays land before reusing them, then drop it
+	if (read_pending) read_done.wait();
+	read_pending = false;
+
+	// overflows before the reset are not reported again, nor counted
+	if (peak_pending) peak_read.wait();
+	peak_pending = false;
+	overflow_reported = false;
+	clInfo.queue.enqueueFillBuffer(clNeighborPeak, (cl_int) 0, 0, sizeof(cl_int));
+
+	// particles start in original order
+	ids.resize(cnt_obj);
+	for (unsigned int i = 0; i < cnt_obj; i++) ids[i] = i;
+	clInfo.queue.enqueueWriteBuffer(clIds, CL_TRUE, 0, cnt_obj * sizeof(int), &ids[0]);
+
+	accumulator = 0.0;
+	alpha = 0.0f;
+}
+
+// host positions and velocities to the device, at rest since the last step
+void Fluid::upload()
+{
+	unsigned int cnt_obj = config.num_particles;
+
+	clInfo.queue.enqueueWriteBuffer(clPositions, CL_FALSE, 0, cnt_obj * PARTICLE_FIELD_SIZE, &positions[0], NULL, profiler.tag("upload"));
+	clInfo.queue.enqueueWriteBuffer(clPrevPositions, CL_FALSE, 0, cnt_obj * PARTICLE_FIELD_SIZE, &positions[0], NULL, profiler.tag("upload"));
+	clInfo.queue.enqueueWriteBuffer(clVelocities, CL_TRUE, 0, cnt_obj * PARTICLE_FIELD_SIZE, &velocities[0], NULL, profiler.tag("upload"));
+
+	prev_positions = positions;
+	step_count = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Checkpoints: the solver state in original particle order, versioned. Each field
+// is a section starting on a page boundary and holding capacity elements (the padded
+// count of the run that saved it), so that a mapping of the file can back device
+// buffers directly. Lambdas are left out: every step computes them afresh before
+// the displacement reads them.
+//-----------------------------------------------------------------------------
+
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_ALIGN 4096
+
+enum CheckpointSection { SECTION_POSITIONS, SECTION_PREV_POSITIONS, SECTION_VELOCITIES, NUM_SECTIONS };
+
+struct CheckpointHeader
+{
+	char magic[8]; // "PBFCKPT"
+	uint32_t version;
+	uint32_t num_particles;
+	uint32_t capacity; // elements per section, no fewer than num_particles
+	uint32_t hash_size;
+	uint64_t step_count;
+	float bb_min[3];
+	float bb_max[3];
+	float cell_size;
+	float skin;
+	float delta_time;
+	float gravity;
+	float density;
+	float mass;
+	float cutoff;
+	uint32_t max_neighbors;
+	uint64_t offsets[NUM_SECTIONS]; // byte offset of each section
+};
+
+static const std::size_t section_element_size[NUM_SECTIONS] = {
+	PARTICLE_FIELD_SIZE, PARTICLE_FIELD_SIZE, PARTICLE_FIELD_SIZE };
+
+static uint64_t alignSection(uint64_t bytes)
+{
+	return (bytes + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+static bool readCheckpointHeader(const char* filename, CheckpointHeader & header)
+{
+	ifstream checkpoint_file(filename, std::ios::in | std::ios::binary);
+	if (!checkpoint_file) { cerr << "Cannot open checkpoint: " << filename << "\n"; return false; }
+
+	checkpoint_file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!checkpoint_file || strncmp(header.magic, "PBFCKPT", 8) != 0) {
+		cerr << "Not a checkpoint: " << filename << "\n";
+		return false;
+	}
+	if (header.version != CHECKPOINT_VERSION) {
+		cerr << "Checkpoint version " << header.version << " unsupported: " << filename << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool loadCheckpointConfig(const char* filename, FluidConfig & config)
+{
+	CheckpointHeader header;
+	if (!readCheckpointHeader(filename, header)) return false;
+
+	config.num_particles = header.num_particles;
+	config.bb_min = glm::vec3(header.bb_min[0], header.bb_min[1], header.bb_min[2]);
+	config.bb_max = glm::vec3(header.bb_max[0], header.bb_max[1], header.bb_max[2]);
+	config.cell_size = header.cell_size;
+	config.hash_size = header.hash_size;
+	config.skin = header.skin;
+	config.max_neighbors = header.max_neighbors;
+	config.delta_time = header.delta_time;
+	config.gravity = header.gravity;
+	config.density = header.density;
+	config.mass = header.mass;
+	config.cutoff = header.cutoff;
+	config.checkpoint = filename;
+	return true;
+}
+
+bool Fluid::saveCheckpoint(const char* filename)
+{
+	// host copies in original order
+	readParticles();
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, "PBFCKPT", 8);
+	header.version = CHECKPOINT_VERSION;
+	header.num_particles = size();
+	header.capacity = (uint32_t) num_padded;
+	header.hash_size = config.hash_size;
+	header.step_count = step_count;
+	for (int c = 0; c < 3; c++) {
+		header.bb_min[c] = config.bb_min[c];
+		header.bb_max[c] = config.bb_max[c];
+	}
+	header.cell_size = config.cell_size;
+	header.skin = config.skin;
+	header.delta_time = config.delta_time;
+	header.gravity = config.gravity;
+	header.density = config.density;
+	header.mass = config.mass;
+	header.cutoff = config.cutoff;
+	header.max_neighbors = config.max_neighbors;
+
+	uint64_t offset = alignSection(sizeof(header));
+	for (int s = 0; s < NUM_SECTIONS; s++) {
+		header.offsets[s] = offset;
+		offset += alignSection(header.capacity * section_element_size[s]);
+	}
+
+	ofstream checkpoint_file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!checkpoint_file) { cerr << "Cannot write checkpoint: " << filename << "\n"; return false; }
+
+	const char* sections[NUM_SECTIONS] = {
+		reinterpret_cast<const char*>(&positions[0]),
+		reinterpret_cast<const char*>(&prev_positions[0]),
+		reinterpret_cast<const char*>(&velocities[0]) };
+
+	// zero padding up to each section, and to the end of the last one
+	vector<char> zeros(CHECKPOINT_ALIGN, 0);
+	auto padTo = [&](uint64_t end) {
+		uint64_t pos;
+		while (checkpoint_file && (pos = (uint64_t) checkpoint_file.tellp()) < end)
+			checkpoint_file.write(&zeros[0], std::min<uint64_t>(zeros.size(), end - pos));
+	};
+
+	checkpoint_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	for (int s = 0; s < NUM_SECTIONS; s++) {
+		padTo(header.offsets[s]);
+		checkpoint_file.write(sections[s], size() * section_element_size[s]);
+	}
+	padTo(offset);
+
+	if (!checkpoint_file) { cerr << "Cannot write checkpoint: " << filename << "\n"; return false; }
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Map the checkpoint once per Fluid, on the first load, and upload it on every
+// initParticles (autotuning restarts from it once per candidate). A CPU device
+// uses the mapped pages as buffer storage (CL_MEM_USE_HOST_PTR) when the sections
+// are large enough, with no copy at all; other devices get them through
+// enqueueWriteBuffer from a read-only mapping.
+//-----------------------------------------------------------------------------
+
+bool Fluid::mapCheckpoint(const char* filename)
+{
+	CheckpointHeader header;
+	if (!readCheckpointHeader(filename, header)) return false;
+	if (header.num_particles != size()) {
+		cerr << "Checkpoint holds " << header.num_particles << " particles, not " << size() << "\n";
+		return false;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	struct stat file_stat;
+	if (fd < 0 || fstat(fd, &file_stat) != 0) {
+		if (fd >= 0) close(fd);
+		cerr << "Cannot open checkpoint: " << filename << "\n";
+		return false;
+	}
+
+	uint64_t end = header.offsets[NUM_SECTIONS - 1] + alignSection(header.capacity * section_element_size[NUM_SECTIONS - 1]);
+	if (header.capacity < header.num_particles || (uint64_t) file_stat.st_size < end) {
+		close(fd);
+		cerr << "Truncated checkpoint: " << filename << "\n";
+		return false;
+	}
+
+	checkpoint_backed = (clInfo.device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) && header.capacity >= num_padded;
+
+	// private mapping: device writes to host-backed buffers stay out of the file
+	int protection = checkpoint_backed ? PROT_READ | PROT_WRITE : PROT_READ;
+	void* mapping = mmap(NULL, file_stat.st_size, protection, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) { cerr << "Cannot map checkpoint: " << filename << "\n"; return false; }
+
+	checkpoint_map = mapping;
+	checkpoint_map_size = file_stat.st_size;
+	checkpoint_fresh = true;
+
+	if (checkpoint_backed) {
+		char* base = static_cast<char*>(mapping);
+		cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR;
+		clPositions = cl::Buffer(clInfo.context, flags, num_padded * PARTICLE_FIELD_SIZE, base + header.offsets[SECTION_POSITIONS]);
+		clPrevPositions = cl::Buffer(clInfo.context, flags, num_padded * PARTICLE_FIELD_SIZE, base + header.offsets[SECTION_PREV_POSITIONS]);
+		clVelocities = cl::Buffer(clInfo.context, flags, num_padded * PARTICLE_FIELD_SIZE, base + header.offsets[SECTION_VELOCITIES]);
+		bindBuffers();
+	}
+	return true;
+}
+
+bool Fluid::loadCheckpoint(const char* filename)
+{
+	if (!checkpoint_map && !mapCheckpoint(filename)) return false;
+
+	char* base = static_cast<char*>(checkpoint_map);
+	const CheckpointHeader & header = *reinterpret_cast<const CheckpointHeader*>(base);
+	std::size_t bytes = size() * PARTICLE_FIELD_SIZE;
+	cl::Buffer* buffers[NUM_SECTIONS] = { &clPositions, &clPrevPositions, &clVelocities };
+
+	// host-backed pages hold the device state of the steps since the last load:
+	// read the saved sections back into them
+	if (checkpoint_backed && !checkpoint_fresh) {
+		ifstream checkpoint_file(filename, std::ios::in | std::ios::binary);
+		for (int s = 0; s < NUM_SECTIONS && checkpoint_file; s++) {
+			void* mapped = clInfo.queue.enqueueMapBuffer(*buffers[s], CL_TRUE, CL_MAP_WRITE, 0, bytes);
+			checkpoint_file.seekg(header.offsets[s]);
+			checkpoint_file.read(static_cast<char*>(mapped), bytes);
+			clInfo.queue.enqueueUnmapMemObject(*buffers[s], mapped);
+		}
+		clInfo.queue.finish();
+		if (!checkpoint_file) { cerr << "Cannot read checkpoint: " << filename << "\n"; return false; }
+	}
+	checkpoint_fresh = false;
+
+	// host copies first, before the device may start writing host-backed pages
+	const glm::vec4* mapped_positions = reinterpret_cast<const glm::vec4*>(base + header.offsets[SECTION_POSITIONS]);
+	const glm::vec4* mapped_prev = reinterpret_cast<const glm::vec4*>(base + header.offsets[SECTION_PREV_POSITIONS]);
+	const glm::vec4* mapped_velocities = reinterpret_cast<const glm::vec4*>(base + header.offsets[SECTION_VELOCITIES]);
+	positions.assign(mapped_positions, mapped_positions + size());
+	prev_positions.assign(mapped_prev, mapped_prev + size());
+	velocities.assign(mapped_velocities, mapped_velocities + size());
+
+	if (!checkpoint_backed) {
+		for (int s = 0; s < NUM_SECTIONS; s++)
+			clInfo.queue.enqueueWriteBuffer(*buffers[s], s == NUM_SECTIONS - 1, 0, bytes, base + header.offsets[s]);
+	}
+
+	// neighbor lists are not saved, nor lambdas: the first step computes both before use
+	clInfo.queue.enqueueFillBuffer(clRebuild, (cl_int) 1, 0, sizeof(cl_int));
+
+	step_count = header.step_count;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Advance the fluid by one time step
+//-----------------------------------------------------------------------------
+
+void Fluid::simulate(float dt)
+{
+	kernels[KERNEL_FORCE].setArg(3, dt);
+	kernels[KERNEL_UPDATE].setArg(4, dt);
+	kernels[KERNEL_PREDICT_CELL].setArg(4, dt);
+	kernels[KERNEL_DISP_UPDATE].setArg(7, dt);
+
+	if (config.skin > 0.0f) checkNeighbors();
+
+	// keep spatial neighbors memory neighbors as the fluid mixes
+	if (config.reorder_interval && step_count > 0 && step_count % config.reorder_interval == 0)
+		reorder();
+	step_count++;
+
+	if (config.fused) {
+		// apply external force and find particles' cells in one pass
+		launch(KERNEL_PREDICT_CELL, size());
+	}
+	else {
+		enqueueStage(STAGE_FORCE);
+		enqueueStage(STAGE_FIND_CELL);
+	}
+
+	enqueueStage(STAGE_BINNING);
+
+	// solve constrain equation
+	unsigned int num_iteration = 5;
+	for (int i = 0; i < num_iteration; ++i)
+	{
+		enqueueStage(STAGE_LAMBDA);
+
+		// calculate displacement, and update particles in the same pass on the last iteration
+		bool per_particle = config.skin == 0.0f && !config.cell_dispatch;
+		if (config.fused && per_particle && i == num_iteration - 1) {
+			launch(KERNEL_DISP_UPDATE, size(), 0, &step_done);
+			return;
+		}
+
+		enqueueStage(STAGE_DISPLACEMENT);
+	}
+
+	// update particle
+	launch(KERNEL_UPDATE, size(), 0, &step_done);
+
+	// confining fluid
+	//launch(KERNEL_VISCOSITY, size());
+}
+
+//-----------------------------------------------------------------------------
+// Neighbor lists hold max_neighbors IDs; a particle with more within cutoff + skin
+// loses the rest, and with them part of its density and displacement. The peak
+// count is read back without waiting and checked on a later step: the first
+// overflow after a restart is reported, with the capacity it would have needed.
+//-----------------------------------------------------------------------------
+
+void Fluid::checkNeighbors()
+{
+	if (peak_pending) {
+		if (peak_read.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) return;
+		peak_pending = false;
+
+		if (neighbor_peak > 0 && !overflow_reported) {
+			cerr << "Neighbor lists overflow: up to " << neighbor_peak << " neighbors within cutoff + skin, capacity "
+				<< config.max_neighbors << "; neighbors past it are dropped, raise --neighbors\n";
+			overflow_reported = true;
+		}
+	}
+
+	clInfo.queue.enqueueReadBuffer(clNeighborPeak, CL_FALSE, 0, sizeof(int), &neighbor_peak, NULL, &peak_read);
+	peak_pending = true;
+}
+
+//-----------------------------------------------------------------------------
+// Enqueue the kernels of one stage of a step, as simulate() runs them
+//-----------------------------------------------------------------------------
+
+void Fluid::enqueueStage(SolverStage stage)
+{
+	unsigned int cnt_cell = config.numCells();
+
+	// one work-group per occupied cell, at most one cell per particle;
+	// groups past the occupied count return at once
+	std::size_t num_groups = std::min(cnt_cell, size());
+
+	switch (stage) {
+
+	case STAGE_FORCE:
+		// apply external force
+		launch(KERNEL_FORCE, size());
+		break;
+
+	case STAGE_FIND_CELL:
+		// find particles' cells
+		launch(KERNEL_FIND_CELL, size());
+		break;
+
+	case STAGE_BINNING:
+		// bin particles by cell: histogram, prefix sum, scatter
+		launch(KERNEL_RESET_CELL, cnt_cell);
+		launch(KERNEL_COUNT_CELL, size());
+		launch(KERNEL_SUM_CELL_BLOCKS, num_scan_blocks * scan_size, scan_size);
+		launch(KERNEL_SCAN_CELL_BLOCKS, scan_size, scan_size); // single work-group over the block sums
+		launch(KERNEL_SCAN_CELL, num_scan_blocks * scan_size, scan_size);
+		launch(KERNEL_SORT_CELL, size());
+
+		// rebuild neighbor lists on device once stale, no host round trip for the flag
+		if (config.skin > 0.0f) {
+			launch(KERNEL_CHECK_SKIN, size());
+			launch(KERNEL_BUILD_NEIGHBORS, size());
+			launch(KERNEL_CLEAR_REBUILD, 1, 1);
+		}
+		break;
+
+	case STAGE_LAMBDA:
+		// calculate lambda
+		if (config.skin > 0.0f) launch(KERNEL_LAMBDA_LIST, size());
+		else if (config.cell_dispatch) launch(KERNEL_LAMBDA_CELL, num_groups * cell_group_size, cell_group_size);
+		else launch(KERNEL_LAMBDA, size());
+		break;
+
+	case STAGE_DISPLACEMENT:
+		// calculate displacement
+		if (config.skin > 0.0f) launch(KERNEL_DISP_LIST, size());
+		else if (config.cell_dispatch) launch(KERNEL_DISP_CELL, num_groups * cell_group_size, cell_group_size);
+		else launch(KERNEL_DISP, size());
+		break;
+
+	case STAGE_UPDATE:
+		// update particle
+		launch(KERNEL_UPDATE, size());
+		break;
+
+	default:
+		// profiled only, as part of other stages or steps
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Fixed time step: run the steps of config.delta_time that elapsed seconds of wall
+// clock add up to, at most config.max_substeps; time beyond that is dropped, so a
+// slow frame slows the fluid down instead of piling up steps
+//-----------------------------------------------------------------------------
+
+unsigned int Fluid::advance(double elapsed)
+{
+	accumulator += elapsed;
+
+	unsigned int steps = 0;
+	while (accumulator >= config.delta_time && steps < config.max_substeps) {
+		simulate(config.delta_time);
+		accumulator -= config.delta_time;
+		steps++;
+	}
+
+	if (accumulator >= config.delta_time)
+		accumulator = std::fmod(accumulator, (double) config.delta_time);
+
+	return steps;
+}
+
+float Fluid::blend() const
+{
+	return (float) (accumulator / config.delta_time);
+}
+
+//-----------------------------------------------------------------------------
+// Sort particles, with their lambdas and original IDs, by Z-order key of their cell
+//-----------------------------------------------------------------------------
+
+void Fluid::reorder()
+{
+	launch(KERNEL_MORTON_KEY, num_sorted);
+
+	// bitonic sort: merge sequences of size stage, compare distance pass halving down to 1
+	for (cl_uint stage = 2; stage <= num_sorted; stage <<= 1) {
+		for (cl_uint pass = stage >> 1; pass > 0; pass >>= 1) {
+			kernels[KERNEL_BITONIC_SORT].setArg(3, stage);
+			kernels[KERNEL_BITONIC_SORT].setArg(4, pass);
+			launch(KERNEL_BITONIC_SORT, num_sorted);
+		}
+	}
+
+	launch(KERNEL_REORDER, size());
+
+	// clPrevPositions stays in the old order: reorder() only runs at the start of a step,
+	// and the update rewrites it for every index before fillInstances or a read uses it
+	clInfo.queue.enqueueCopyBuffer(clPositionsSorted, clPositions, 0, 0, size() * PARTICLE_FIELD_SIZE, NULL, profiler.tag(stageName(STAGE_REORDER)));
+	clInfo.queue.enqueueCopyBuffer(clVelocitiesSorted, clVelocities, 0, 0, size() * PARTICLE_FIELD_SIZE, NULL, profiler.tag(stageName(STAGE_REORDER)));
+	clInfo.queue.enqueueCopyBuffer(clPredictedSorted, clPredicted, 0, 0, size() * PARTICLE_FIELD_SIZE, NULL, profiler.tag(stageName(STAGE_REORDER)));
+	clInfo.queue.enqueueCopyBuffer(clLambdasSorted, clLambdas, 0, 0, size() * sizeof(float), NULL, profiler.tag(stageName(STAGE_REORDER)));
+	clInfo.queue.enqueueCopyBuffer(clIdsSorted, clIds, 0, 0, size() * sizeof(int), NULL, profiler.tag(stageName(STAGE_REORDER)));
+
+	// neighbor lists refer to old indices; filled in queue order, no host wait
+	clInfo.queue.enqueueFillBuffer(clRebuild, (cl_int) 1, 0, sizeof(cl_int));
+}
+
+//-----------------------------------------------------------------------------
+// Enqueue kernels[k] with its cached work-group size unless one is given
+//-----------------------------------------------------------------------------
+
+static const char* stage_names[NUM_PROFILED_STAGES] = {
+	"force", "find_cell", "binning", "lambda", "displacement", "update",
+	"neighbors", "reorder", "instances", "viscosity", "force+binning", "displacement+update" };
+
+const char* stageName(SolverStage stage)
+{
+	return stage_names[stage];
+}
+
+void Fluid::launch(KernelId k, std::size_t work_items, std::size_t local_work_size, cl::Event* event)
+{
+	const char* stage = stageName(kernel_info[k].stage);
+	cl::Event* tagged = event ? NULL : profiler.tag(stage, k);
+
+	runKernel(kernels[k], clInfo, work_items, local_work_size ? local_work_size : group_sizes[k], event ? event : tagged);
+
+	if (event) profiler.record(stage, *event, k);
+}
+
+//-----------------------------------------------------------------------------
+// Work-group size tuning: "<particles> <kernel> <size>" and "<particles> fused <0|1>"
+// lines in tuning/<device>.tune, for as many particle counts as were tuned
+//-----------------------------------------------------------------------------
+
+string Fluid::tuningFile() const
+{
+	string name = clInfo.device.getInfo<CL_DEVICE_NAME>().c_str();
+	for (char & c : name) if (!isalnum((unsigned char) c)) c = '_';
+	return "tuning/" + name + ".tune";
+}
+
+void Fluid::loadTuning()
+{
+	ifstream tuning_file(tuningFile(), std::ios::in);
+	if (!tuning_file) return;
+
+	map<unsigned int, vector<pair<string, unsigned long>>> entries;
+	string line;
+	while (getline(tuning_file, line)) {
+		istringstream ins(line);
+		unsigned int count;
+		string key;
+		unsigned long value;
+		if (line.empty() || line[0] == '#' || !(ins >> count >> key >> value)) continue;
+		entries[count].push_back(make_pair(key, value));
+	}
+	if (entries.empty()) return;
+
+	// the particle count tuned nearest to ours, on a log scale
+	auto distance = [this](unsigned int count) { return std::fabs(std::log((double) count / size())); };
+	auto nearest = entries.begin();
+	for (auto it = entries.begin(); it != entries.end(); ++it)
+		if (distance(it->first) < distance(nearest->first)) nearest = it;
+
+	for (auto & entry : nearest->second) {
+		if (entry.first == "fused") {
+			config.fused = config.fused || entry.second;
+			continue;
+		}
+		for (unsigned int k = 0; k < NUM_KERNELS; k++) {
+			if (!kernel_info[k].tunable || entry.first != kernel_info[k].name) continue;
+			if (entry.second > 0 && entry.second <= kernels[k].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clInfo.device))
+				group_sizes[k] = entry.second;
+		}
+	}
+
+	cout << "Using work-group sizes tuned for " << nearest->first << " particles from " << tuningFile() << "\n";
+}
+
+bool Fluid::autotune(unsigned int steps)
+{
+	if (!profiler.enabled) { cerr << "Autotuning needs a queue with CL_QUEUE_PROFILING_ENABLE\n"; return false; }
+
+	std::size_t max_sizes[NUM_KERNELS];
+	std::size_t largest = 1;
+	for (unsigned int k = 0; k < NUM_KERNELS; k++) {
+		max_sizes[k] = kernels[k].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clInfo.device);
+		if (kernel_info[k].tunable) largest = std::max(largest, max_sizes[k]);
+	}
+
+	// best size and time of each kernel, for plain [0] and fused [1] kernels
+	std::size_t best_sizes[2][NUM_KERNELS];
+	vector<double> best_ms[2];
+	double total_ms[2] = { 0.0, 0.0 };
+
+	for (int variant = 0; variant < 2; variant++) {
+		config.fused = variant == 1;
+		best_ms[variant].assign(NUM_KERNELS, 0.0);
+		std::copy(group_sizes, group_sizes + NUM_KERNELS, best_sizes[variant]);
+
+		// powers of two from 16, each kernel capped at its own maximum
+		for (std::size_t candidate = 16; candidate < 2 * largest; candidate <<= 1) {
+			for (unsigned int k = 0; k < NUM_KERNELS; k++)
+				if (kernel_info[k].tunable) group_sizes[k] = std::min(candidate, max_sizes[k]);
+
+			// every candidate starts from the same state; the first step pays for warm-up
+			initParticles();
+			simulate();
+			profiler.reset();
+			for (unsigned int i = 0; i < steps; i++) simulate();
+			profiler.collect();
+			vector<double> ms = profiler.kernelTotals();
+			ms.resize(NUM_KERNELS, 0.0);
+
+			for (unsigned int k = 0; k < NUM_KERNELS; k++) {
+				bool capped = candidate > max_sizes[k] && candidate / 2 >= max_sizes[k]; // timed at this size already
+				if (!kernel_info[k].tunable || ms[k] <= 0.0 || capped) continue;
+				if (best_ms[variant][k] == 0.0 || ms[k] < best_ms[variant][k]) {
+					best_ms[variant][k] = ms[k];
+					best_sizes[variant][k] = group_sizes[k];
+				}
+			}
+		}
+
+		for (double ms : best_ms[variant]) total_ms[variant] += ms;
+		cout << (variant ? "fused" : "plain") << " kernels: " << total_ms[variant] / steps << " ms/step at best sizes\n";
+	}
+
+	int winner = total_ms[1] < total_ms[0] ? 1 : 0;
+	config.fused = winner == 1;
+	std::copy(best_sizes[winner], best_sizes[winner] + NUM_KERNELS, group_sizes);
+	initParticles();
+	profiler.reset();
+
+	// keep the entries of other particle counts
+	vector<string> kept;
+	{
+		ifstream tuning_file(tuningFile(), std::ios::in);
+		string line;
+		unsigned int count;
+		while (getline(tuning_file, line))
+			if (!(istringstream(line) >> count) || count != size()) kept.push_back(line);
+	}
+
+	mkdir("tuning", 0755);
+	ofstream tuning_file(tuningFile(), std::ios::out | std::ios::trunc);
+	for (const string & line : kept) tuning_file << line << "\n";
+	tuning_file << size() << " fused " << winner << "\n";
+	for (unsigned int k = 0; k < NUM_KERNELS; k++) {
+		if (!kernel_info[k].tunable || best_ms[winner][k] == 0.0) continue;
+		tuning_file << size() << " " << kernel_info[k].name << " " << group_sizes[k] << "\n";
+		cout << "\t" << kernel_info[k].name << ": " << group_sizes[k]
+			<< " (" << best_ms[winner][k] / steps << " ms/step)\n";
+	}
+
+	if (!tuning_file) { cerr << "Cannot write tuning file: " << tuningFile() << "\n"; return false; }
+	cout << "Saved to " << tuningFile() << "\n";
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Fill render instances on the device
+//-----------------------------------------------------------------------------
+
+void Fluid::fillInstances(cl::Buffer & instances, float alpha)
+{
+	kernels[KERNEL_FILL_INSTANCES].setArg(3, instances);
+	kernels[KERNEL_FILL_INSTANCES].setArg(4, alpha);
+	launch(KERNEL_FILL_INSTANCES, size());
+}
+
+//-----------------------------------------------------------------------------
+// Copy particles back to host, in original order
+//-----------------------------------------------------------------------------
+
+void Fluid::readParticles()
+{
+	enqueueSnapshot();
+	read_done.wait();
+	publishSnapshot();
+}
+
+void Fluid::readLambdas(vector<float> & lambdas)
+{
+	// particles first, for the permutation of the device arrays
+	readParticles();
+	vector<float> lambdas_back(size());
+	clInfo.queue.enqueueReadBuffer(clLambdas, CL_TRUE, 0, size() * sizeof(float), &lambdas_back[0], NULL, profiler.tag("readback"));
+	lambdas.resize(size());
+	for (unsigned int i = 0; i < size(); i++) lambdas[ids[i]] = lambdas_back[i];
+}
+
+void Fluid::finish()
+{
+	clInfo.queue.finish();
+
+	// report an overflow of the last steps before the caller stops stepping
+	if (config.skin > 0.0f) checkNeighbors();
+}
+
+//-----------------------------------------------------------------------------
+// Pipelined copy back: publish the snapshot enqueued by the previous call, then
+// enqueue one of the latest step without waiting for it. The previous copies sit
+// before the latest step in the in-order queue, so the wait leaves it running.
+//-----------------------------------------------------------------------------
+
+void Fluid::readParticlesAsync()
+{
+	if (read_pending) {
+		read_done.wait();
+		publishSnapshot();
+	}
+
+	enqueueSnapshot();
+	clInfo.queue.flush();
+}
+
+void Fluid::enqueueSnapshot()
+{
+	std::size_t bytes = size() * PARTICLE_FIELD_SIZE;
+	positions_back.resize(size());
+	prev_positions_back.resize(size());
+	velocities_back.resize(size());
+	alpha_back = blend();
+
+	clInfo.queue.enqueueReadBuffer(clPositions, CL_FALSE, 0, bytes, &positions_back[0], NULL, profiler.tag("readback"));
+	clInfo.queue.enqueueReadBuffer(clPrevPositions, CL_FALSE, 0, bytes, &prev_positions_back[0], NULL, profiler.tag("readback"));
+	if (config.reorder_interval) {
+		clInfo.queue.enqueueReadBuffer(clVelocities, CL_FALSE, 0, bytes, &velocities_back[0], NULL, profiler.tag("readback"));
+		clInfo.queue.enqueueReadBuffer(clIds, CL_FALSE, 0, size() * sizeof(int), &ids[0], NULL, &read_done);
+	}
+	else {
+		clInfo.queue.enqueueReadBuffer(clVelocities, CL_FALSE, 0, bytes, &velocities_back[0], NULL, &read_done);
+	}
+	profiler.record("readback", read_done);
+
+	read_pending = true;
+}
+
+void Fluid::publishSnapshot()
+{
+	if (config.reorder_interval) {
+		for (unsigned int i = 0; i < size(); i++) {
+			positions[ids[i]] = positions_back[i];
+			prev_positions[ids[i]] = prev_positions_back[i];
+			velocities[ids[i]] = velocities_back[i];
+		}
+	}
+	else {
+		positions.swap(positions_back);
+		prev_positions.swap(prev_positions_back);
+		velocities.swap(velocities_back);
+	}
+	alpha = alpha_back;
+
+	read_pending = false;
+}
@@ -0,0 +1,254 @@
+#ifndef FLUID_H
+#define FLUID_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <glm/glm.hpp>
+
+#include "cl.h"
+#include "ParticleLayout.h"
+#include "Profiler.h"
+
+// host copies of particle fields are float4 arrays, element for element as on the device
+static_assert(sizeof(glm::vec4) == PARTICLE_FIELD_SIZE, "particle field must match float4");
+static_assert(sizeof(cl_float4) == PARTICLE_FIELD_SIZE, "particle field must match float4");
+static_assert(sizeof(Lookup_t) == LOOKUP_SIZE, "cell lookup entry must match Particle.cl");
+
+// Simulation parameters chosen at startup, from command line or scene file
+struct FluidConfig
+{
+	unsigned int num_particles = 1200;
+
+	glm::vec3 bb_min = glm::vec3(-1.8f, -1.0f, -1.8f); // bound box corners
+	glm::vec3 bb_max = glm::vec3( 1.8f,  5.0f,  1.8f);
+
+	float cell_size = 0.0f; // grid cell edge, raised to cutoff when smaller
+	unsigned int hash_size = 0; // slots of the hashed grid, 0 for a dense grid over the bound box
+	bool cell_dispatch = false; // solve with one work-group per occupied cell (dense grid only)
+
+	/** Verlet neighbor lists, used when skin > 0 */
+	float skin = 0.0f; // lists hold neighbors within cutoff + skin, rebuilt once a particle moves skin / 2
+	unsigned int max_neighbors = 128; // list capacity per particle, overflows are reported (Fluid::checkNeighbors)
+
+	unsigned int reorder_interval = 0; // steps between Z-order sorts of the particle array, 0 = never
+
+	bool fused = false; // fused kernels: force + prediction + cell, last displacement + update
+	bool tuned = true; // take work-group sizes (and fused kernels) from the device's tuning file, see Fluid::autotune
+
+	bool native = false; // solve on host threads (NativeSolver) instead of OpenCL, where the program offers both
+	unsigned int threads = 0; // worker threads of the native solver, 0 for one per hardware thread
+
+	/** Physics */
+	float delta_time = 0.01f; // fixed step, passed to the kernels at launch
+	unsigned int max_substeps = 8; // steps per advance() at most, when rendering falls behind
+	float gravity = 9.8f;
+	float density = 1.0f;
+	float mass = 1.0f;
+	float cutoff = 0.21f; // smoothing radius
+
+	std::string checkpoint; // state to resume from instead of the initial lattice, see loadCheckpointConfig
+
+	float cellSize() const; // no shorter than the neighbor search radius
+	glm::ivec3 gridDim() const; // cells per axis, covering the bound box
+	unsigned int numCells() const; // entries of the cell lookup table
+
+	// -D options baking domain, grid and physics into Particle.cl
+	std::string buildOptions() const;
+};
+
+// Read "key value ..." lines (particles, bounds, cell, hash, dispatch, skin, neighbors, reorder, fused, backend, threads,
+// substeps, physics) into config
+bool loadScene(const char* filename, FluidConfig & config);
+
+// Set particle count, domain, grid and physics to those a checkpoint was saved with, and resume from it
+bool loadCheckpointConfig(const char* filename, FluidConfig & config);
+
+// Parse --scene, -n, --bounds, --cell, --hash, --cell-dispatch, --skin, --neighbors, --reorder, --fused, --no-tune,
+// --backend, --threads, --dt, --substeps and --resume; returns index of first unparsed argument
+int parseArgs(int argc, char* argv[], FluidConfig & config);
+
+// Stages of a step, for timing them one at a time (see Fluid::enqueueStage), then stages of kernels
+// only the profiler tells apart: list rebuilds, sorts, render instances, fused passes
+enum SolverStage {
+	STAGE_FORCE, STAGE_FIND_CELL, STAGE_BINNING, STAGE_LAMBDA, STAGE_DISPLACEMENT, STAGE_UPDATE, NUM_STAGES,
+	STAGE_NEIGHBORS = NUM_STAGES, STAGE_REORDER, STAGE_INSTANCES, STAGE_VISCOSITY, STAGE_FORCE_BINNING, STAGE_DISPLACEMENT_UPDATE,
+	NUM_PROFILED_STAGES
+};
+
+// Name of a stage in profiles and bench results
+const char* stageName(SolverStage stage);
+
+// Host side of a solver backend: the OpenCL solver (Fluid) and the scalar reference (ReferenceSolver)
+class Solver {
+
+public:
+	FluidConfig config;
+
+	/** Host copy of particle positions and velocities (xyz) in their original order, filled by readParticles() */
+	std::vector<glm::vec4> positions;
+	std::vector<glm::vec4> velocities;
+	std::vector<glm::vec4> prev_positions; // one step earlier
+
+	unsigned long step_count = 0;
+
+	/** Methods */
+	Solver(const FluidConfig & config) : config(config) {}
+	virtual ~Solver() {}
+
+	virtual void initParticles() = 0; // initial lattice, or the checkpoint named in config
+	virtual void setParticles(const std::vector<glm::vec4> & positions, const std::vector<glm::vec4> & velocities) = 0; // xyz, size() each
+	void simulate() { simulate(config.delta_time); }
+	virtual void simulate(float dt) = 0; // may return before the step is done
+	virtual void finish() = 0; // waits for every step simulate() started
+	virtual void readParticles() = 0;
+	virtual void readLambdas(std::vector<float> & lambdas) = 0; // of the last constraint iteration, original order; reads particles too
+
+	unsigned int size() const { return config.num_particles; }
+
+protected:
+	void initLattice(); // particles of the initial column, at rest
+};
+
+class Fluid : public Solver {
+
+public:
+	float alpha = 0.0f; // fraction of the next step elapsed when particles were read, to interpolate with
+
+	/** Signals the end of the last step enqueued by simulate() */
+	cl::Event step_done;
+
+	/** Timestamps of every kernel and transfer, by stage; enabled when the queue was created
+	 *  with CL_QUEUE_PROFILING_ENABLE. Collect it now and then, tagged events pile up. */
+	Profiler profiler;
+
+	/** Methods */
+	Fluid(CLInfo & clInfo, const FluidConfig & config);
+	~Fluid();
+
+	void initParticles();
+	void setParticles(const std::vector<glm::vec4> & positions, const std::vector<glm::vec4> & velocities);
+	bool saveCheckpoint(const char* filename); // waits for the queue
+	using Solver::simulate; // enqueues one step of config.delta_time and returns, see step_done
+	void simulate(float dt);
+	void finish();
+	void enqueueStage(SolverStage stage); // one stage of a step alone, never fused; simulate() sets dt
+
+	unsigned int advance(double elapsed); // fixed-step accumulator, returns steps enqueued
+	float blend() const; // fraction of a step accumulated past the last one
+	void readParticles(); // waits for the step, the only host sync of a frame
+	void readParticlesAsync(); // publishes the step read back last call, starts reading the latest
+	void readLambdas(std::vector<float> & lambdas);
+
+	// Enqueue writing render instances of all particles (layout of ParticleInst in main.h) to
+	// instances, typically a cl::BufferGL acquired from OpenGL; particles never reach the host.
+	// Positions are interpolated alpha of the way from before the last step to after it.
+	void fillInstances(cl::Buffer & instances, float alpha);
+
+	// Time every kernel at each candidate work-group size, with plain and with fused kernels,
+	// over steps steps from the initial state; keep the fastest and save them to the tuning
+	// file of this device for this particle count. Needs CL_QUEUE_PROFILING_ENABLE.
+	bool autotune(unsigned int steps);
+
+private:
+	CLInfo & clInfo;
+
+	/** OpenCL program; kernels[] and group_sizes[] are indexed by KernelId, kernel_info lists
+	 *  entry point, profiler stage and tunability of each id in the same order */
+	cl::Program program;
+	enum KernelId {
+		KERNEL_FORCE, KERNEL_FIND_CELL, KERNEL_LAMBDA, KERNEL_DISP, KERNEL_UPDATE,
+		KERNEL_VISCOSITY, KERNEL_RESET_CELL, KERNEL_COUNT_CELL, KERNEL_SCAN_CELL, KERNEL_SORT_CELL,
+		KERNEL_LAMBDA_CELL, KERNEL_DISP_CELL, KERNEL_CHECK_SKIN, KERNEL_BUILD_NEIGHBORS, KERNEL_CLEAR_REBUILD,
+		KERNEL_LAMBDA_LIST, KERNEL_DISP_LIST, KERNEL_MORTON_KEY, KERNEL_BITONIC_SORT, KERNEL_REORDER,
+		KERNEL_FILL_INSTANCES, KERNEL_PREDICT_CELL, KERNEL_DISP_UPDATE, KERNEL_SUM_CELL_BLOCKS, KERNEL_SCAN_CELL_BLOCKS,
+		NUM_KERNELS
+	};
+	struct KernelInfo
+	{
+		const char* name; // entry point in Particle.cl
+		SolverStage stage; // of its profiler events
+		bool tunable; // free to run at any work-group size, see autotune
+	};
+	static const KernelInfo kernel_info[];
+	cl::Kernel kernels[NUM_KERNELS];
+	std::size_t group_sizes[NUM_KERNELS]; // CL_KERNEL_WORK_GROUP_SIZE of each kernel, queried once, or tuned
+
+	/** Device buffers, padded to a whole number of work-groups */
+	std::size_t num_padded;
+	cl::Buffer clPositions; // one float4 per particle and field, see ParticleLayout.h
+	cl::Buffer clVelocities;
+	cl::Buffer clPredicted;
+	cl::Buffer clPrevPositions; // positions before the last step, for interpolation
+	cl::Buffer clIndices;
+	cl::Buffer clLookup;
+	cl::Buffer clCellIds; // cell ID of each particle
+	cl::Buffer clRanks; // rank of each particle inside its cell
+	cl::Buffer clLambdas;
+	cl::Buffer clOccupied; // compact list of non-empty cells
+	cl::Buffer clNumOccupied; // length of that list
+	cl::Buffer clBlockSums; // (particles, occupied cells) per scan block, then their exclusive scan
+	cl::Buffer clNeighbors; // max_neighbors IDs per particle
+	cl::Buffer clNeighborCounts;
+	cl::Buffer clListPos; // predicted positions when lists were last built
+	cl::Buffer clRebuild; // flag raised when lists are stale
+	cl::Buffer clNeighborPeak; // most neighbors a particle found past max_neighbors since restart, 0 if none
+	cl::Buffer clIds; // original ID of each particle, permuted along with it
+	cl::Buffer clSortKeys; // Z-order keys, padded to a power of two
+	cl::Buffer clSortOrder; // particle index for each sorted slot
+	cl::Buffer clPositionsSorted; // gather targets of a reorder
+	cl::Buffer clVelocitiesSorted;
+	cl::Buffer clPredictedSorted;
+	cl::Buffer clLambdasSorted;
+	cl::Buffer clIdsSorted;
+	std::size_t num_sorted;
+
+	/** Back snapshot being read from the device, published to positions / velocities once complete */
+	std::vector<glm::vec4> positions_back;
+	std::vector<glm::vec4> prev_positions_back;
+	std::vector<glm::vec4> velocities_back;
+	float alpha_back;
+	std::vector<int> ids; // permutation of the back snapshot once particles are reordered
+	cl::Event read_done;
+	bool read_pending = false;
+
+	/** Neighbor list overflow, read back a step late without waiting */
+	int neighbor_peak = 0;
+	cl::Event peak_read;
+	bool peak_pending = false;
+	bool overflow_reported = false;
+
+	double accumulator = 0.0; // wall-clock seconds not yet simulated
+
+	/** Mapping of config.checkpoint for the life of the Fluid, NULL when none; it backs
+	 *  clPositions, clPrevPositions and clVelocities on CPU devices */
+	void* checkpoint_map = NULL;
+	std::size_t checkpoint_map_size = 0;
+	bool checkpoint_backed = false;
+	bool checkpoint_fresh = false; // mapped pages still hold the saved state
+
+
+	std::size_t scan_size; // work-group size of the cell prefix sum, cells per scan block
+	std::size_t num_scan_blocks;
+	std::size_t cell_group_size; // work-group size of the cell-centric solver
+	unsigned int cell_capacity; // particles staged in local memory per cell-centric chunk
+
+	/** Methods */
+	void buildKernels();
+	void initBuffers();
+	void bindBuffers();
+	void restart();
+	void upload();
+	bool mapCheckpoint(const char* filename);
+	bool loadCheckpoint(const char* filename);
+	std::string tuningFile() const;
+	void loadTuning();
+	void reorder();
+	void checkNeighbors();
+	void enqueueSnapshot();
+	void publishSnapshot();
+	void launch(KernelId k, std::size_t work_items, std::size_t local_work_size = 0, cl::Event* event = NULL);
+};
+
+#endif
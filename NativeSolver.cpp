@@ -0,0 +1,315 @@
+#include "NativeSolver.h"
+#include "SolverMath.h"
+
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+/** Namespace */
+using namespace std;
+
+// particles per task of the passes in original order, cells per task of the scan
+static const size_t kParticleGrain = 4096;
+static const size_t kCellGrain = 16384;
+
+// solver tasks per worker, spare ones for idle workers to steal
+static const size_t kBlocksPerThread = 8;
+static const size_t kMinBlockParticles = 256;
+
+//-----------------------------------------------------------------------------
+// Constructor
+//-----------------------------------------------------------------------------
+
+NativeSolver::NativeSolver(const FluidConfig & config) :
+	Solver(config),
+	pool(config.threads),
+	cell_size(config.cellSize()),
+	grid_dim(config.gridDim())
+{
+	unsigned int cnt_obj = config.num_particles;
+	num_cells = grid_dim.x * grid_dim.y * grid_dim.z;
+
+	positions.assign(cnt_obj, glm::vec4(0.0f));
+	prev_positions.assign(cnt_obj, glm::vec4(0.0f));
+	velocities.assign(cnt_obj, glm::vec4(0.0f));
+	predicted.assign(cnt_obj, glm::vec4(0.0f));
+	lambdas.assign(cnt_obj, 0.0f);
+
+	cell_ids.resize(cnt_obj);
+	cell_ranks.resize(cnt_obj);
+	cell_table.resize(cnt_obj);
+	cell_offsets.resize(num_cells + 1);
+	block_sums.resize((num_cells + kCellGrain - 1) / kCellGrain);
+	cell_counts.reset(new atomic<int>[num_cells]);
+	for (unsigned int c = 0; c < num_cells; c++) cell_counts[c].store(0, memory_order_relaxed);
+
+	sorted_predicted.resize(cnt_obj);
+	sorted_corrected.resize(cnt_obj);
+	sorted_lambdas.resize(cnt_obj);
+}
+
+//-----------------------------------------------------------------------------
+// Initial particles: the lattice column, or given ones. A checkpoint in config
+// is not read; checkpoints need the OpenCL backend.
+//-----------------------------------------------------------------------------
+
+void NativeSolver::initParticles()
+{
+	if (!config.checkpoint.empty())
+		cerr << "Checkpoints need the OpenCL backend, starting from the initial lattice\n";
+
+	initLattice();
+	restart();
+}
+
+void NativeSolver::setParticles(const vector<glm::vec4> & new_positions, const vector<glm::vec4> & new_velocities)
+{
+	std::copy(new_positions.begin(), new_positions.begin() + size(), positions.begin());
+	std::copy(new_velocities.begin(), new_velocities.begin() + size(), velocities.begin());
+	restart();
+}
+
+// at rest since the last step
+void NativeSolver::restart()
+{
+	prev_positions = positions;
+	std::fill(lambdas.begin(), lambdas.end(), 0.0f);
+	step_count = 0;
+}
+
+void NativeSolver::readLambdas(vector<float> & lambdas)
+{
+	lambdas = this->lambdas;
+}
+
+//-----------------------------------------------------------------------------
+// Advance the fluid by one time step. Passes over particles in original order
+// (prediction, binning) take fixed ranges of them; constraint passes and the
+// update take blocks of cells, over particles copied out in cell order.
+//-----------------------------------------------------------------------------
+
+void NativeSolver::simulate(float dt)
+{
+	step_count++;
+
+	// apply external force, predict positions, and count particles per cell
+	pool.parallelFor(size(), kParticleGrain, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; i++) {
+			glm::vec3 velocity = glm::vec3(velocities[i]);
+			velocity.y += -config.gravity * dt * config.mass;
+			velocities[i] = glm::vec4(velocity, 0.0f);
+
+			glm::vec3 predicted_pos = glm::vec3(positions[i]) + velocity * dt;
+			predicted[i] = glm::vec4(predicted_pos, 0.0f);
+
+			cell_ids[i] = cellIndex(cellCoord(predicted_pos));
+			cell_ranks[i] = cell_counts[cell_ids[i]].fetch_add(1, memory_order_relaxed);
+		}
+	});
+
+	// cells stay those of the predicted positions for all iterations, as on the device
+	binParticles();
+	partitionCells();
+
+	// solve constrain equation
+	unsigned int num_iteration = 5;
+	for (unsigned int iter = 0; iter < num_iteration; iter++) {
+		forEachBlock([&](int first, int last) {
+			for (int slot = first; slot < last; slot++)
+				sorted_lambdas[slot] = calcLambda(slot);
+		});
+		forEachBlock([&](int first, int last) {
+			for (int slot = first; slot < last; slot++)
+				sorted_corrected[slot] = glm::vec4(displace(slot), 0.0f);
+		});
+		sorted_predicted.swap(sorted_corrected);
+	}
+
+	// update particles, back in original order
+	forEachBlock([&](int first, int last) {
+		for (int slot = first; slot < last; slot++) {
+			int index = cell_table[slot];
+
+			glm::vec3 predicted_pos = glm::vec3(sorted_predicted[slot]);
+			bounding(predicted_pos);
+
+			glm::vec3 velocity = (predicted_pos - glm::vec3(positions[index])) * (1.0f / dt);
+
+			prev_positions[index] = positions[index];
+			positions[index] = glm::vec4(predicted_pos, 0.0f);
+			velocities[index] = glm::vec4(velocity, 0.0f);
+			lambdas[index] = sorted_lambdas[slot];
+		}
+	});
+}
+
+//-----------------------------------------------------------------------------
+// Dense grid anchored at the bound box min corner, coordinates clamped into it
+//-----------------------------------------------------------------------------
+
+glm::ivec3 NativeSolver::cellCoord(const glm::vec3 & position) const
+{
+	glm::ivec3 cell = glm::ivec3(glm::floor((position - config.bb_min) * (1.0f / cell_size)));
+	return glm::clamp(cell, glm::ivec3(0), grid_dim - 1);
+}
+
+int NativeSolver::cellIndex(const glm::ivec3 & cell) const
+{
+	return (cell.z * grid_dim.y + cell.y) * grid_dim.x + cell.x;
+}
+
+int NativeSolver::neighborCells(const glm::vec3 & position, int* cells) const
+{
+	glm::ivec3 cell = cellCoord(position);
+	glm::ivec3 lo = glm::max(cell - 1, glm::ivec3(0));
+	glm::ivec3 hi = glm::min(cell + 1, grid_dim - 1);
+
+	int count = 0;
+	for (int z = lo.z; z <= hi.z; z++)
+		for (int y = lo.y; y <= hi.y; y++)
+			for (int x = lo.x; x <= hi.x; x++)
+				cells[count++] = cellIndex(glm::ivec3(x, y, z));
+	return count;
+}
+
+// prefix sum of the cell counts in two parallel passes, then scatter particles to their slots
+void NativeSolver::binParticles()
+{
+	pool.parallelFor(num_cells, kCellGrain, [&](size_t first, size_t last) {
+		int sum = 0;
+		for (size_t c = first; c < last; c++) sum += cell_counts[c].load(memory_order_relaxed);
+		block_sums[first / kCellGrain] = sum;
+	});
+
+	int carry = 0;
+	for (int & sum : block_sums) {
+		int block = sum;
+		sum = carry;
+		carry += block;
+	}
+
+	// counts go back to zero for the next step
+	pool.parallelFor(num_cells, kCellGrain, [&](size_t first, size_t last) {
+		int offset = block_sums[first / kCellGrain];
+		for (size_t c = first; c < last; c++) {
+			cell_offsets[c] = offset;
+			offset += cell_counts[c].exchange(0, memory_order_relaxed);
+		}
+	});
+	cell_offsets[num_cells] = size();
+
+	pool.parallelFor(size(), kParticleGrain, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; i++) {
+			int slot = cell_offsets[cell_ids[i]] + cell_ranks[i];
+			cell_table[slot] = i;
+			sorted_predicted[slot] = predicted[i];
+		}
+	});
+}
+
+// cut the cells into runs of about equal particle counts, a few per worker
+void NativeSolver::partitionCells()
+{
+	size_t per_block = std::max(kMinBlockParticles, size() / (kBlocksPerThread * pool.size()) + 1);
+
+	blocks.clear();
+	blocks.push_back(0);
+	for (size_t target = per_block; target < size(); target += per_block) {
+		int cell = std::lower_bound(cell_offsets.begin(), cell_offsets.end(), (int) target) - cell_offsets.begin();
+		if (cell > blocks.back() && cell < (int) num_cells) blocks.push_back(cell);
+	}
+	blocks.push_back(num_cells);
+}
+
+void NativeSolver::forEachBlock(const function<void(int first, int last)> & body)
+{
+	pool.parallelFor(blocks.size() - 1, 1, [&](size_t first, size_t last) {
+		for (size_t b = first; b < last; b++)
+			body(cell_offsets[blocks[b]], cell_offsets[blocks[b + 1]]);
+	});
+}
+
+//-----------------------------------------------------------------------------
+// Internel forces (kernel_calc_lambda and displace in Particle.cl), by slot.
+// Same terms as ReferenceSolver, with the powers multiplied out and the spiky
+// kernels folded into s_corr and the gradient: results agree to rounding.
+//-----------------------------------------------------------------------------
+
+float NativeSolver::calcLambda(int slot) const
+{
+	glm::vec3 predicted_pos = glm::vec3(sorted_predicted[slot]);
+	float cutoff = config.cutoff;
+	float cutoff2 = cutoff * cutoff;
+	float inv_cutoff = 1.0f / cutoff;
+
+	float numerator = 0.0f;
+	float denominator = 1.0f * kEpsilon;
+	float ct = -0.00243f * kPi * config.density * pow(cutoff, 5.0f);
+	glm::vec3 self_grad = glm::vec3(0.0f);
+
+	int cells[27];
+	int num_neighbor_cells = neighborCells(predicted_pos, cells);
+	for (int c = 0; c < num_neighbor_cells; c++) {
+		for (int other = cell_offsets[cells[c]]; other < cell_offsets[cells[c] + 1]; other++) {
+			glm::vec3 position = predicted_pos - glm::vec3(sorted_predicted[other]);
+			float radius2 = glm::dot(position, position);
+			if (radius2 > cutoff2) continue;
+			float radius = std::sqrt(radius2);
+			float ratio = radius * inv_cutoff;
+			float poly = 1.0f - ratio * ratio;
+			numerator += poly * poly * poly;
+			float spiky = (1.0f - ratio) * (1.0f - ratio);
+			float inter_grad_scale = spiky * spiky;
+			denominator += inter_grad_scale;
+			// OpenCL normalize() leaves a zero vector as it is
+			if (radius > 0.0f) self_grad += inter_grad_scale * (position / radius);
+		}
+	}
+
+	denominator += glm::dot(self_grad, self_grad);
+	numerator *= config.mass;
+
+	return ct * (numerator / config.density - 1.0f) / denominator;
+}
+
+glm::vec3 NativeSolver::displace(int slot) const
+{
+	glm::vec3 predicted_pos = glm::vec3(sorted_predicted[slot]);
+	float lambda = sorted_lambdas[slot];
+	float cutoff = config.cutoff;
+	float inv_cutoff = 1.0f / cutoff;
+	float grad_ct = -45.0f / kPi / pow(cutoff, 4.0f); // w_grad_spiky
+
+	glm::vec3 displacement = glm::vec3(0.0f);
+
+	int cells[27];
+	int num_neighbor_cells = neighborCells(predicted_pos, cells);
+	for (int c = 0; c < num_neighbor_cells; c++) {
+		for (int other = cell_offsets[cells[c]]; other < cell_offsets[cells[c] + 1]; other++) {
+			glm::vec3 position = predicted_pos - glm::vec3(sorted_predicted[other]);
+			float radius = glm::length(position);
+			if (radius > cutoff) continue; // both kernels vanish
+			float core = 1.0f - radius * inv_cutoff;
+			float spiky = core * core * core; // w_spiky(radius) / w_spiky(0)
+			float s_corr = -0.01f * (spiky * spiky) * (spiky * spiky);
+			glm::vec3 grad = position * (grad_ct * core * core / (radius + kEpsilon));
+			displacement += grad * (lambda + sorted_lambdas[other] + s_corr);
+		}
+	}
+
+	predicted_pos += displacement;
+
+	bounding(predicted_pos);
+
+	return predicted_pos / config.density;
+}
+
+// clamp into the bound box, true when position was outside
+bool NativeSolver::bounding(glm::vec3 & position) const
+{
+	if (glm::any(glm::lessThan(position, config.bb_min)) || glm::any(glm::greaterThan(position, config.bb_max))) {
+		position = glm::clamp(position, config.bb_min, config.bb_max);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,71 @@
+#ifndef NATIVE_SOLVER_H
+#define NATIVE_SOLVER_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Fluid.h"
+#include "ThreadPool.h"
+
+// Per-particle step of Particle.cl in native C++ on a work-stealing thread pool, for many-core
+// hosts without a GPU: no OpenCL runtime and no kernel compile. Each step bins the particles
+// into the dense grid over the bound box with a counting sort, copies them out in cell order,
+// and solves the constraint over blocks of consecutive cells holding about the same number of
+// particles, one block per task. Displacements are Jacobi, as in ReferenceSolver.
+class NativeSolver : public Solver {
+
+public:
+	/** Methods */
+	NativeSolver(const FluidConfig & config); // config.threads workers, 0 for one per hardware thread
+
+	void initParticles();
+	void setParticles(const std::vector<glm::vec4> & positions, const std::vector<glm::vec4> & velocities);
+	using Solver::simulate;
+	void simulate(float dt); // the whole step, done when it returns
+	void finish() {}
+	void readParticles() {} // host arrays are the solver's own
+	void readLambdas(std::vector<float> & lambdas);
+
+	unsigned int threads() const { return pool.size(); }
+	unsigned long steals() const { return pool.steals(); }
+
+private:
+	ThreadPool pool;
+
+	std::vector<glm::vec4> predicted;
+	std::vector<float> lambdas; // of the last iteration, original order
+
+	/** Dense grid */
+	float cell_size;
+	glm::ivec3 grid_dim;
+	unsigned int num_cells;
+	std::vector<int> cell_ids; // cell of each particle
+	std::vector<int> cell_ranks; // rank of each particle inside its cell
+	std::unique_ptr<std::atomic<int>[]> cell_counts; // zero between steps
+	std::vector<int> cell_offsets; // first slot of each cell, plus one past the last
+	std::vector<int> cell_table; // particle ID of each slot
+	std::vector<int> block_sums; // of the cell counts, per scan task
+	std::vector<int> blocks; // first cell of each solver task, then num_cells
+
+	/** Particles by slot, in cell order */
+	std::vector<glm::vec4> sorted_predicted;
+	std::vector<glm::vec4> sorted_corrected; // swapped with sorted_predicted after each pass
+	std::vector<float> sorted_lambdas;
+
+	/** Methods */
+	void restart();
+	glm::ivec3 cellCoord(const glm::vec3 & position) const;
+	int cellIndex(const glm::ivec3 & cell) const;
+	int neighborCells(const glm::vec3 & position, int* cells) const; // up to 27 cells, returns how many
+	void binParticles();
+	void partitionCells();
+	void forEachBlock(const std::function<void(int first, int last)> & body); // slot range of each cell block, in parallel
+	float calcLambda(int slot) const;
+	glm::vec3 displace(int slot) const;
+	bool bounding(glm::vec3 & position) const;
+};
+
+#endif
@@ -1,17 +1,9 @@
 /** Particle.cl */
 
-typedef struct __Particle_t
-{
-	float3 position;
-	float3 velocity;
-	float3 predicted_pos;
-} Particle_t;
+// particle fields as separate float4 arrays, and the cell lookup entry, shared with the host
+#include "ParticleLayout.h"
 
-typedef struct __Lookup_t
-{
-	int offset;
-	int size;
-} Lookup_t;
+typedef char particle_field_check[(sizeof(float4) == PARTICLE_FIELD_SIZE) ? 1 : -1];
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -20,16 +12,28 @@ __constant float kInf = 1e20;
 __constant float kEpsilon = 1e-3;
 __constant float kPi = 3.14159265;
 
-// constant control
-__constant float delta_time = 0.01f;
+// parameters baked in by the host at build time (-D), defaults below match the host's;
+// the time step is not among them, it is a kernel argument so the host can vary it freely
+#ifndef GRAVITY
+#define GRAVITY 9.8f
+#endif
+#ifndef DENSITY
+#define DENSITY 1.0f
+#endif
+#ifndef MASS
+#define MASS 1.0f
+#endif
+#ifndef CUTOFF
+#define CUTOFF 0.21f
+#endif
 
 // constant physics
-__constant float gravity_accer = 9.8f;
-__constant float density_water = 1.0f;
+__constant float gravity_accer = GRAVITY;
+__constant float density_water = DENSITY;
 
 // constant particle
-__constant float mass = 1.0f;
-__constant float cutoff = 0.21f;
+__constant float mass = MASS;
+__constant float cutoff = CUTOFF;
 
 // bound faces indices
 #define BB_RIGHT  0
@@ -39,15 +43,24 @@ __constant float cutoff = 0.21f;
 #define BB_FRONT  4
 #define BB_BACK   5
 
+// bound box corners, chosen at startup by the host (-D build options)
+#ifndef BB_MIN_X
+#define BB_MIN_X -1.8f
+#define BB_MIN_Y -1.0f
+#define BB_MIN_Z -1.8f
+#define BB_MAX_X  1.8f
+#define BB_MAX_Y  5.0f
+#define BB_MAX_Z  1.8f
+#endif
+
 // bound box sizes
-#define BB_SCALE 1.8f
 __constant float bb_sizes[6] = {
-	 BB_SCALE, // right
-	-BB_SCALE, // left
-	 5.0f, // top
-	-1.0f, // buttom
-	 BB_SCALE, // front
-	-BB_SCALE, // back
+	BB_MAX_X, // right
+	BB_MIN_X, // left
+	BB_MAX_Y, // top
+	BB_MIN_Y, // buttom
+	BB_MAX_Z, // front
+	BB_MIN_Z, // back
 };
 
 // bound box inner normal (normal toward INSIDE of bound box)
@@ -64,8 +77,26 @@ __constant float3 bb_normals[6] = {
 #define GRID_X 0
 #define GRID_Y 1
 #define GRID_Z 2
-__constant int grid_dim[3] = {10, 10, 10};
-__constant int grid_size = 1000;
+
+// grid of cubic cells anchored at the bound box min corner, chosen at startup by the host (-D)
+// cell edge is never shorter than cutoff, so the 27 cells around a particle cover its kernel support
+#ifndef CELL_SIZE
+#define CELL_SIZE CUTOFF
+#endif
+#ifndef GRID_DIM_X
+#define GRID_DIM_X 18
+#define GRID_DIM_Y 29
+#define GRID_DIM_Z 18
+#endif
+
+__constant int grid_dim[3] = {GRID_DIM_X, GRID_DIM_Y, GRID_DIM_Z};
+__constant int grid_size = GRID_DIM_X * GRID_DIM_Y * GRID_DIM_Z;
+
+// hashed grid (-DHASH_GRID): unbounded cells hashed into a table of HASH_TABLE_SIZE slots,
+// memory scales with the table instead of the domain volume
+#if defined(HASH_GRID) && !defined(HASH_TABLE_SIZE)
+#define HASH_TABLE_SIZE 262144
+#endif
 
 __constant int3 grid_neighbors[27] = {
 	// body center
@@ -95,7 +126,15 @@ __constant int3 grid_neighbors[27] = {
 	//((int3) {-1,  1,  1}), ((int3) { 0,  1,  1}), ((int3) { 1,  1,  1}),
 };
 
-#define MAX_NEIGHBORS 500
+// capacity of each particle's neighbor list, chosen at startup by the host (-D)
+#ifndef MAX_NEIGHBORS
+#define MAX_NEIGHBORS 128
+#endif
+
+// Verlet skin: lists hold neighbors within cutoff + SKIN, and stay valid until a particle moves SKIN / 2
+#ifndef SKIN
+#define SKIN 0.0f
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -108,14 +147,41 @@ float3 w_grad_spiky(float3 position, float div);
 int cell_3to1(int3 cell);
 int3 cell_1to3(int cell_id);
 
+int3 cell_coord(float3 position);
+int cell_index(int3 cell);
 int celling(float3 position);
 bool out_of_grid(int3 cell);
+bool slot_visited(int* visited, int count, int slot);
+
+int2 scan_group(int2 value, __local int2* scratch);
+
+int gather_neighborhood(int3 cell, __global const Lookup_t* cell_lookup, int* nbr_offset, int* nbr_size);
+
+void load_neighborhood(
+	__local float4* neighbor_pos,
+	int first,
+	int count,
+	const int* nbr_offset,
+	const int* nbr_size,
+	__global const float4* predicted,
+	__global const int* cell_ptc_table,
+	__global const float* lambdas);
+
+#ifdef HASH_GRID
+ulong cell_key(int3 cell);
+int cell_hash(ulong key);
+#endif
+
+uint morton_spread(uint value);
+uint morton_key(int3 cell);
 
 int get_neighboring_particles(
-	int* particle_table,
+	__global int* particle_table,
 	float3 position,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table);
+	float radius,
+	__global const float4* predicted,
+	__global const Lookup_t* cell_lookup,
+	__global const int* cell_ptc_table);
 
 bool neighboring(float3 pos_1, float3 pos_2);
 
@@ -123,74 +189,389 @@ float3 reflect(float3 incidence, float3 normal);
 
 int hitting_face(float3 vec);
 
-bool bounding(Particle_t* particle);
-
-__kernel void kernel_externel_force(__global Particle_t* particles);
-
-__kernel void kernel_find_cell(__constant Particle_t* particles, __global int* cells);
+bool bounding(float3* predicted_pos);
+
+// per-particle stages shared by the plain and the fused kernels
+float3 apply_external_force(
+	__global const float4* restrict positions,
+	__global float4* restrict velocities,
+	unsigned int index,
+	float dt);
+
+float3 displace(
+	__global const float4* predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const float* restrict lambdas,
+	unsigned int index);
+
+void update_particle(
+	__global float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict prev_positions,
+	float3 predicted_pos,
+	unsigned int index,
+	float dt);
+
+__kernel void kernel_externel_force(
+	__global const float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict predicted,
+	float dt,
+	unsigned int num_particles);
+
+__kernel void kernel_find_cell(
+	__global const float4* restrict predicted,
+	__global int* restrict cell_ids,
+	unsigned int num_particles);
+
+__kernel void kernel_predict_cell(
+	__global const float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict predicted,
+	__global int* restrict cell_ids,
+	float dt,
+	unsigned int num_particles);
+
+__kernel void kernel_reset_cell(__global Lookup_t* cell_lookup, unsigned int num_cells);
+
+__kernel void kernel_count_cell(
+	__global const int* cell_ids,
+	__global Lookup_t* cell_lookup,
+	__global int* cell_ranks,
+	unsigned int num_particles);
+
+__kernel void kernel_sum_cell_blocks(
+	__global const Lookup_t* cell_lookup,
+	__global int2* block_sums,
+	__local int2* scratch,
+	unsigned int num_cells);
+
+__kernel void kernel_scan_cell_blocks(
+	__global int2* block_sums,
+	__global int* num_occupied,
+	__local int2* scratch,
+	unsigned int num_blocks);
+
+__kernel void kernel_scan_cell(
+	__global Lookup_t* cell_lookup,
+	__global const int2* block_sums,
+	__global int* occupied_cells,
+	__local int2* scratch,
+	unsigned int num_cells);
+
+__kernel void kernel_sort_cell(
+	__global const int* cell_ids,
+	__global const int* cell_ranks,
+	__global const Lookup_t* cell_lookup,
+	__global int* cell_ptc_table,
+	unsigned int num_particles);
 
 __kernel void kernel_calc_lambda(
-	__constant Particle_t* particles,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table,
-	__global float* lambdas);
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global float* restrict lambdas,
+	unsigned int num_particles);
 
 __kernel void kernel_calc_disp(
-	__global Particle_t* particles,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table,
-	__constant float* lambdas);
-
-__kernel void kernel_update(__global Particle_t* particles);
+	__global float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const float* restrict lambdas,
+	unsigned int num_particles);
+
+__kernel void kernel_calc_lambda_cell(
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const int* restrict occupied_cells,
+	__global const int* restrict num_occupied,
+	__global float* restrict lambdas,
+	__local float4* neighbor_pos,
+	unsigned int capacity);
+
+__kernel void kernel_calc_disp_cell(
+	__global float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const int* restrict occupied_cells,
+	__global const int* restrict num_occupied,
+	__global const float* restrict lambdas,
+	__local float4* neighbor_pos,
+	unsigned int capacity);
+
+__kernel void kernel_check_skin(
+	__global const float4* restrict predicted,
+	__global const float4* restrict list_pos,
+	__global int* restrict rebuild,
+	unsigned int num_particles);
+
+__kernel void kernel_build_neighbors(
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global int* restrict neighbors,
+	__global int* restrict neighbor_counts,
+	__global float4* restrict list_pos,
+	__global const int* restrict rebuild,
+	__global int* restrict neighbor_peak,
+	unsigned int num_particles);
+
+__kernel void kernel_clear_rebuild(__global int* rebuild);
+
+__kernel void kernel_calc_lambda_list(
+	__global const float4* restrict predicted,
+	__global const int* restrict neighbors,
+	__global const int* restrict neighbor_counts,
+	__global float* restrict lambdas,
+	unsigned int num_particles);
+
+__kernel void kernel_calc_disp_list(
+	__global float4* restrict predicted,
+	__global const int* restrict neighbors,
+	__global const int* restrict neighbor_counts,
+	__global const float* restrict lambdas,
+	unsigned int num_particles);
+
+__kernel void kernel_update(
+	__global float4* restrict positions,
+	__global float4* restrict velocities,
+	__global const float4* restrict predicted,
+	__global float4* restrict prev_positions,
+	float dt,
+	unsigned int num_particles);
+
+__kernel void kernel_calc_disp_update(
+	__global float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const float* restrict lambdas,
+	__global float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict prev_positions,
+	float dt,
+	unsigned int num_particles);
+
+__kernel void kernel_morton_key(
+	__global const float4* restrict positions,
+	__global uint* restrict keys,
+	__global int* restrict order,
+	unsigned int num_particles,
+	unsigned int num_sorted);
+
+__kernel void kernel_bitonic_sort(
+	__global uint* keys,
+	__global int* order,
+	unsigned int num_sorted,
+	unsigned int stage,
+	unsigned int pass);
+
+__kernel void kernel_reorder(
+	__global const float4* restrict positions,
+	__global const float4* restrict velocities,
+	__global const float4* restrict predicted,
+	__global float4* restrict sorted_positions,
+	__global float4* restrict sorted_velocities,
+	__global float4* restrict sorted_predicted,
+	__global const float* restrict lambdas,
+	__global float* restrict sorted_lambdas,
+	__global const int* restrict ids,
+	__global int* restrict sorted_ids,
+	__global const int* restrict order,
+	unsigned int num_particles);
+
+__kernel void kernel_fill_instances(
+	__global const float4* restrict positions,
+	__global const float4* restrict prev_positions,
+	__global const float4* restrict velocities,
+	__global float4* restrict instances,
+	float alpha,
+	unsigned int num_particles);
 
 __kernel void kernel_viscosity(
-	__global Particle_t* particles,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table);
+	__global float4* restrict velocities,
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	unsigned int num_particles);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////// externel forces //////////
 
-__kernel void kernel_externel_force(__global Particle_t* particles)
+__kernel void kernel_externel_force(
+	__global const float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict predicted,
+	float dt,
+	unsigned int num_particles)
 {
 	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
 
-	// perform external force on particle
-	particles[index].velocity.y += -gravity_accer * delta_time * mass;
-
-	// predict position only affected by external forces
-	particles[index].predicted_pos = particles[index].position + particles[index].velocity * delta_time;
+	predicted[index] = (float4) (apply_external_force(positions, velocities, index, dt), 0.0f);
 }
 
 ////////// find neighbors //////////
 
-__kernel void kernel_find_cell(__constant Particle_t* particles, __global int* cell_ids)
+__kernel void kernel_find_cell(
+	__global const float4* restrict predicted,
+	__global int* restrict cell_ids,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	cell_ids[index] = celling(predicted[index].xyz);
+}
+
+////////// fused: externel forces, prediction and cell, one pass over the particles //////////
+
+__kernel void kernel_predict_cell(
+	__global const float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict predicted,
+	__global int* restrict cell_ids,
+	float dt,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	float3 predicted_pos = apply_external_force(positions, velocities, index, dt);
+	predicted[index] = (float4) (predicted_pos, 0.0f);
+	cell_ids[index] = celling(predicted_pos);
+}
+
+////////// bin particles into cells (counting sort) //////////
+
+// clear cell table, so that cells emptied since last frame do not keep stale entries
+__kernel void kernel_reset_cell(__global Lookup_t* cell_lookup, unsigned int num_cells)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_cells) return;
+
+	cell_lookup[index].offset = 0;
+	cell_lookup[index].size = 0;
+}
+
+// histogram: count particles per cell, and remember each particle's rank inside its cell
+__kernel void kernel_count_cell(
+	__global const int* cell_ids,
+	__global Lookup_t* cell_lookup,
+	__global int* cell_ranks,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	cell_ranks[index] = atomic_inc(&cell_lookup[cell_ids[index]].size);
+}
+
+// exclusive prefix sum of cell sizes into cell offsets, and of occupancy into a compact list of
+// occupied cells, over as many work-groups as blocks of cells in three launches:
+//   kernel_sum_cell_blocks   (particles, occupied cells) of each block
+//   kernel_scan_cell_blocks  exclusive scan of the block sums, one work-group
+//   kernel_scan_cell         scan inside each block, plus its block offset
+// all three with the same work-group size, which is the block size
+
+__kernel void kernel_sum_cell_blocks(
+	__global const Lookup_t* cell_lookup,
+	__global int2* block_sums,
+	__local int2* scratch,
+	unsigned int num_cells)
+{
+	unsigned int cell = get_global_id(0);
+	int size = (cell < num_cells) ? cell_lookup[cell].size : 0;
+
+	int2 total = scan_group((int2) (size, size > 0 ? 1 : 0), scratch);
+
+	if (get_local_id(0) == get_local_size(0) - 1) block_sums[get_group_id(0)] = total;
+}
+
+// block sums are few (cells / work-group size), one work-group sweeps them with a running carry
+__kernel void kernel_scan_cell_blocks(
+	__global int2* block_sums,
+	__global int* num_occupied,
+	__local int2* scratch,
+	unsigned int num_blocks)
+{
+	unsigned int lid = get_local_id(0);
+	unsigned int lsize = get_local_size(0);
+
+	int2 carry = (int2) (0, 0); // (particles, occupied cells)
+
+	for (unsigned int base = 0; base < num_blocks; base += lsize)
+	{
+		unsigned int block = base + lid;
+		int2 sum = (block < num_blocks) ? block_sums[block] : (int2) (0, 0);
+
+		int2 inclusive = scan_group(sum, scratch);
+		if (block < num_blocks) block_sums[block] = carry + inclusive - sum;
+
+		carry += scratch[lsize - 1];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0) num_occupied[0] = carry.y;
+}
+
+__kernel void kernel_scan_cell(
+	__global Lookup_t* cell_lookup,
+	__global const int2* block_sums,
+	__global int* occupied_cells,
+	__local int2* scratch,
+	unsigned int num_cells)
+{
+	unsigned int cell = get_global_id(0);
+	int size = (cell < num_cells) ? cell_lookup[cell].size : 0;
+
+	int2 inclusive = scan_group((int2) (size, size > 0 ? 1 : 0), scratch);
+	int2 block_offset = block_sums[get_group_id(0)];
+
+	if (cell < num_cells)
+	{
+		cell_lookup[cell].offset = block_offset.x + inclusive.x - size;
+		if (size > 0) occupied_cells[block_offset.y + inclusive.y - 1] = cell;
+	}
+}
+
+// scatter particle IDs to their slots in the cell-sorted table
+__kernel void kernel_sort_cell(
+	__global const int* cell_ids,
+	__global const int* cell_ranks,
+	__global const Lookup_t* cell_lookup,
+	__global int* cell_ptc_table,
+	unsigned int num_particles)
 {
 	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
 
-	cell_ids[index] = celling(particles[index].predicted_pos);
+	int cell_id = cell_ids[index];
+	cell_ptc_table[cell_lookup[cell_id].offset + cell_ranks[index]] = index;
 }
 
 ////////// internel forces //////////
 
 __kernel void kernel_calc_lambda(
-	__constant Particle_t* particles,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table,
-	__global float* lambdas)
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global float* restrict lambdas,
+	unsigned int num_particles)
 {
 	unsigned int index = get_global_id(0);
-	unsigned int total = get_global_size(0);
+	if (index >= num_particles) return;
 
-	Particle_t particle = particles[index];
+	float3 predicted_pos = predicted[index].xyz;
 
 	float numerator = 0.0f;
 	float denominator = 1.0f * kEpsilon;
 	float ct = -0.00243f * kPi * density_water * pow(cutoff, 5);
 	float3 self_grad = ((float3) {0.0f, 0.0f, 0.0f});
 
-	//for (unsigned int i = 0; i < total; i++)
+	//for (unsigned int i = 0; i < num_particles; i++)
 	//{
 	//	if (neighboring(particle.position, particles[i].position))
 	//	{
@@ -205,19 +586,20 @@ __kernel void kernel_calc_lambda(
 	//	}
 	//}
 
-	int cell_id = celling(particle.position);
-	int3 cell = cell_1to3(cell_id);
+	int3 cell = cell_coord(predicted_pos);
+	int visited[27];
 	for (int i = 0; i < 27; i++)
 	{
 		int3 neighbor_cell = cell + grid_neighbors[i];
 		if (out_of_grid(neighbor_cell)) continue;
-		int neighbor_cell_id = cell_3to1(neighbor_cell);
+		int neighbor_cell_id = cell_index(neighbor_cell);
+		if (slot_visited(visited, i, neighbor_cell_id)) continue;
 		int offset = cell_lookup[neighbor_cell_id].offset;
 		int num_ptc = cell_lookup[neighbor_cell_id].size;
 		for (int j = 0; j < num_ptc; j++)
 		{
 			int ptc_id = cell_ptc_table[offset + j];
-			float3 position = particle.predicted_pos - particles[ptc_id].predicted_pos;
+			float3 position = predicted_pos - predicted[ptc_id].xyz;
 			float radius = length(position);
 			if (radius > cutoff) continue;
 			float ratio = radius / cutoff;
@@ -228,123 +610,422 @@ __kernel void kernel_calc_lambda(
 		}
 	}
 
-	//int neighboring_particles[MAX_NEIGHBORS];
-	//int num_ptc = get_neighboring_particles(&neighboring_particles[0], particle.position, cell_lookup, cell_ptc_table);
-	//for (int i = 0; i < num_ptc; i++)
-	//{
-	//	int ptc_id = neighboring_particles[i];
-	//	float3 position = particle.predicted_pos - particles[ptc_id].predicted_pos;
-	//	float radius = length(position);
-	//	if (radius > cutoff) continue;
-	//	float ratio = radius / cutoff;
-	//	numerator += mass * pow(1.0f - ratio * ratio, 3);
-	//	float inter_grad_scale = pow(1.0f - ratio, 4);
-	//	denominator += inter_grad_scale;
-	//	self_grad += inter_grad_scale * normalize(position);
-	//}
-
 	denominator += dot(self_grad, self_grad);
 
 	lambdas[index] = ct * (numerator / density_water - 1.0f) / denominator;
 }
 
 __kernel void kernel_calc_disp(
-	__global Particle_t* particles,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table,
-	__constant float* lambdas)
+	__global float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const float* restrict lambdas,
+	unsigned int num_particles)
 {
 	unsigned int index = get_global_id(0);
-	unsigned int total = get_global_size(0);
+	if (index >= num_particles) return;
+
+	predicted[index] = (float4) (displace(predicted, cell_lookup, cell_ptc_table, lambdas, index), 0.0f);
+}
+
+////////// internel forces, over Verlet neighbor lists //////////
+
+// raise the rebuild flag once any particle has moved half the skin since its list was built
+__kernel void kernel_check_skin(
+	__global const float4* restrict predicted,
+	__global const float4* restrict list_pos,
+	__global int* restrict rebuild,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	if (distance(predicted[index].xyz, list_pos[index].xyz) > 0.5f * SKIN)
+		rebuild[0] = 1;
+}
 
-	Particle_t particle = particles[index];
+// list neighbors within cutoff + skin, only when the rebuild flag is raised; a list that
+// overflows keeps the first MAX_NEIGHBORS, and neighbor_peak the most any particle found
+__kernel void kernel_build_neighbors(
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global int* restrict neighbors,
+	__global int* restrict neighbor_counts,
+	__global float4* restrict list_pos,
+	__global const int* restrict rebuild,
+	__global int* restrict neighbor_peak,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles || !rebuild[0]) return;
+
+	float3 predicted_pos = predicted[index].xyz;
+
+	int found = get_neighboring_particles(
+		&neighbors[index * MAX_NEIGHBORS], predicted_pos, cutoff + SKIN,
+		predicted, cell_lookup, cell_ptc_table);
+
+	neighbor_counts[index] = min(found, MAX_NEIGHBORS);
+	if (found > MAX_NEIGHBORS) atomic_max(neighbor_peak, found);
+
+	list_pos[index] = (float4) (predicted_pos, 0.0f);
+}
+
+__kernel void kernel_clear_rebuild(__global int* rebuild)
+{
+	if (get_global_id(0) == 0) rebuild[0] = 0;
+}
+
+__kernel void kernel_calc_lambda_list(
+	__global const float4* restrict predicted,
+	__global const int* restrict neighbors,
+	__global const int* restrict neighbor_counts,
+	__global float* restrict lambdas,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	float3 predicted_pos = predicted[index].xyz;
+
+	float numerator = 0.0f;
+	float denominator = 1.0f * kEpsilon;
+	float ct = -0.00243f * kPi * density_water * pow(cutoff, 5);
+	float3 self_grad = ((float3) {0.0f, 0.0f, 0.0f});
+
+	__global const int* neighboring_particles = &neighbors[index * MAX_NEIGHBORS];
+	int num_ptc = neighbor_counts[index];
+	for (int i = 0; i < num_ptc; i++)
+	{
+		int ptc_id = neighboring_particles[i];
+		float3 position = predicted_pos - predicted[ptc_id].xyz;
+		float radius = length(position);
+		if (radius > cutoff) continue;
+		float ratio = radius / cutoff;
+		numerator += mass * pow(1.0f - ratio * ratio, 3);
+		float inter_grad_scale = pow(1.0f - ratio, 4);
+		denominator += inter_grad_scale;
+		self_grad += inter_grad_scale * normalize(position);
+	}
+
+	denominator += dot(self_grad, self_grad);
+
+	lambdas[index] = ct * (numerator / density_water - 1.0f) / denominator;
+}
+
+__kernel void kernel_calc_disp_list(
+	__global float4* restrict predicted,
+	__global const int* restrict neighbors,
+	__global const int* restrict neighbor_counts,
+	__global const float* restrict lambdas,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	float3 predicted_pos = predicted[index].xyz;
 	float lambda = lambdas[index];
 
 	float3 displacement = ((float3) {0.0f,  0.0f,  0.0f});
 
-	//for (unsigned int i = 0; i < total; i++)
-	//{
-	//	if (neighboring(particle.position, particles[i].position))
-	//	{
-	//		float3 position = particle.predicted_pos - particles[i].predicted_pos;
-	//		float s_corr = 0.0f;
-	//		//s_corr = w_spiky(length(position), cutoff) / w_spiky(0.1f * cutoff, cutoff);
-	//		//s_corr = -0.0001f * pow(s_corr, 4);
-	//		displacement += w_grad_spiky(position, cutoff) * (lambda + lambdas[i] + s_corr);
-	//	}
-	//}
+	__global const int* neighboring_particles = &neighbors[index * MAX_NEIGHBORS];
+	int num_ptc = neighbor_counts[index];
+	for (int i = 0; i < num_ptc; i++)
+	{
+		int ptc_id = neighboring_particles[i];
+		float3 position = predicted_pos - predicted[ptc_id].xyz;
+		float s_corr = 0.0f;
+		s_corr = w_spiky(length(position), cutoff) / w_spiky(0, cutoff);
+		s_corr = -0.01f * pow(s_corr, 4);
+		displacement += w_grad_spiky(position, cutoff) * (lambda + lambdas[ptc_id] + s_corr);
+	}
 
-	int cell_id = celling(particle.position);
-	int3 cell = cell_1to3(cell_id);
-	for (int i = 0; i < 27; i++)
+	predicted_pos += displacement;
+
+	bounding(&predicted_pos);
+
+	predicted[index] = (float4) (predicted_pos / density_water, 0.0f);
+}
+
+////////// internel forces, one work-group per occupied cell //////////
+
+// The work-group stages the predicted positions of its cell's 27-cell neighborhood in __local
+// memory once, in chunks of capacity particles, and every particle of the cell is solved against it.
+// Dense grid only: a hashed slot can hold particles of several cells.
+
+__kernel void kernel_calc_lambda_cell(
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const int* restrict occupied_cells,
+	__global const int* restrict num_occupied,
+	__global float* restrict lambdas,
+	__local float4* neighbor_pos,
+	unsigned int capacity)
+{
+	unsigned int group = get_group_id(0);
+	if (group >= num_occupied[0]) return; // uniform across the work-group
+
+	unsigned int lid = get_local_id(0);
+	unsigned int lsize = get_local_size(0);
+
+	int3 cell = cell_1to3(occupied_cells[group]);
+
+	int nbr_offset[27];
+	int nbr_size[27];
+	int total = gather_neighborhood(cell, cell_lookup, nbr_offset, nbr_size);
+
+	float ct = -0.00243f * kPi * density_water * pow(cutoff, 5);
+
+	// own cell is the first of the neighborhood; one of its particles per work item per batch
+	for (int batch = 0; batch < nbr_size[0]; batch += lsize)
 	{
-		int3 neighbor_cell = cell + grid_neighbors[i];
-		if (out_of_grid(neighbor_cell)) continue;
-		int neighbor_cell_id = cell_3to1(neighbor_cell);
-		int offset = cell_lookup[neighbor_cell_id].offset;
-		int num_ptc = cell_lookup[neighbor_cell_id].size;
-		for (int j = 0; j < num_ptc; j++)
+		bool active = batch + lid < nbr_size[0];
+		int index = active ? cell_ptc_table[nbr_offset[0] + batch + lid] : 0;
+		float3 predicted_pos = predicted[index].xyz;
+
+		float numerator = 0.0f;
+		float denominator = 1.0f * kEpsilon;
+		float3 self_grad = ((float3) {0.0f, 0.0f, 0.0f});
+
+		for (int first = 0; first < total; first += capacity)
 		{
-			int ptc_id = cell_ptc_table[offset + j];
-			float3 position = particle.predicted_pos - particles[ptc_id].predicted_pos;
-			float s_corr = 0.0f;
-			s_corr = w_spiky(length(position), cutoff) / w_spiky(0, cutoff);
-			s_corr = -0.01f * pow(s_corr, 4);
-			displacement += w_grad_spiky(position, cutoff) * (lambda + lambdas[ptc_id] + s_corr);
+			int count = min((int) capacity, total - first);
+
+			load_neighborhood(neighbor_pos, first, count, nbr_offset, nbr_size, predicted, cell_ptc_table, 0);
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			for (int j = 0; active && j < count; j++)
+			{
+				float3 position = predicted_pos - neighbor_pos[j].xyz;
+				float radius = length(position);
+				if (radius > cutoff) continue;
+				float ratio = radius / cutoff;
+				numerator += mass * pow(1.0f - ratio * ratio, 3);
+				float inter_grad_scale = pow(1.0f - ratio, 4);
+				denominator += inter_grad_scale;
+				self_grad += inter_grad_scale * normalize(position);
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
 		}
+
+		denominator += dot(self_grad, self_grad);
+
+		if (active) lambdas[index] = ct * (numerator / density_water - 1.0f) / denominator;
 	}
+}
 
-	//int neighboring_particles[MAX_NEIGHBORS];
-	//int num_ptc = get_neighboring_particles(&neighboring_particles[0], particle.position, cell_lookup, cell_ptc_table);
-	//for (int i = 0; i < num_ptc; i++)
-	//{
-	//	int ptc_id = neighboring_particles[i];
-	//	float3 position = particle.predicted_pos - particles[ptc_id].predicted_pos;
-	//	float s_corr = 0.0f;
-	//	s_corr = w_spiky(length(position), cutoff) / w_spiky(0, cutoff);
-	//	s_corr = -0.01f * pow(s_corr, 4);
-	//	displacement += w_grad_spiky(position, cutoff) * (lambda + lambdas[ptc_id] + s_corr);
-	//}
+__kernel void kernel_calc_disp_cell(
+	__global float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const int* restrict occupied_cells,
+	__global const int* restrict num_occupied,
+	__global const float* restrict lambdas,
+	__local float4* neighbor_pos,
+	unsigned int capacity)
+{
+	unsigned int group = get_group_id(0);
+	if (group >= num_occupied[0]) return; // uniform across the work-group
+
+	unsigned int lid = get_local_id(0);
+	unsigned int lsize = get_local_size(0);
+
+	int3 cell = cell_1to3(occupied_cells[group]);
+
+	int nbr_offset[27];
+	int nbr_size[27];
+	int total = gather_neighborhood(cell, cell_lookup, nbr_offset, nbr_size);
+
+	for (int batch = 0; batch < nbr_size[0]; batch += lsize)
+	{
+		bool active = batch + lid < nbr_size[0];
+		int index = active ? cell_ptc_table[nbr_offset[0] + batch + lid] : 0;
+		float3 predicted_pos = predicted[index].xyz;
+		float lambda = lambdas[index];
+
+		float3 displacement = ((float3) {0.0f,  0.0f,  0.0f});
 
-	particle.predicted_pos += displacement;
+		for (int first = 0; first < total; first += capacity)
+		{
+			int count = min((int) capacity, total - first);
+
+			// neighbor lambdas ride along in w
+			load_neighborhood(neighbor_pos, first, count, nbr_offset, nbr_size, predicted, cell_ptc_table, lambdas);
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			for (int j = 0; active && j < count; j++)
+			{
+				float3 position = predicted_pos - neighbor_pos[j].xyz;
+				float s_corr = 0.0f;
+				s_corr = w_spiky(length(position), cutoff) / w_spiky(0, cutoff);
+				s_corr = -0.01f * pow(s_corr, 4);
+				displacement += w_grad_spiky(position, cutoff) * (lambda + neighbor_pos[j].w + s_corr);
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		if (!active) continue;
 
-	bounding(&particle);
+		predicted_pos += displacement;
 
-	particles[index].predicted_pos = particle.predicted_pos / density_water;
+		bounding(&predicted_pos);
+
+		predicted[index] = (float4) (predicted_pos / density_water, 0.0f);
+	}
 }
 
 ////////// update status of particles //////////
 
-__kernel void kernel_update(__global Particle_t* particles)
+__kernel void kernel_update(
+	__global float4* restrict positions,
+	__global float4* restrict velocities,
+	__global const float4* restrict predicted,
+	__global float4* restrict prev_positions,
+	float dt,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	update_particle(positions, velocities, prev_positions, predicted[index].xyz, index, dt);
+}
+
+////////// fused: last displacement iteration and update, one pass over the particles //////////
+
+// Neighbors read only predicted positions, which this kernel writes exactly as
+// kernel_calc_disp does; positions and velocities are private to each particle.
+// kernel_viscosity adds nothing yet (its sum is commented out), so neither does this.
+__kernel void kernel_calc_disp_update(
+	__global float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const float* restrict lambdas,
+	__global float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict prev_positions,
+	float dt,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	float3 predicted_pos = displace(predicted, cell_lookup, cell_ptc_table, lambdas, index);
+	predicted[index] = (float4) (predicted_pos, 0.0f);
+
+	update_particle(positions, velocities, prev_positions, predicted_pos, index, dt);
+}
+
+////////// reorder particles along a Z-order curve of cells //////////
+
+// sort key of each particle, padding past num_particles sorts last
+__kernel void kernel_morton_key(
+	__global const float4* restrict positions,
+	__global uint* restrict keys,
+	__global int* restrict order,
+	unsigned int num_particles,
+	unsigned int num_sorted)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_sorted) return;
+
+	keys[index] = (index < num_particles) ? morton_key(cell_coord(positions[index].xyz)) : UINT_MAX;
+	order[index] = index;
+}
+
+// one compare-exchange pass of a bitonic sort over a power-of-two number of keys;
+// stage is the size of the bitonic sequences being merged, pass the compare distance
+__kernel void kernel_bitonic_sort(
+	__global uint* keys,
+	__global int* order,
+	unsigned int num_sorted,
+	unsigned int stage,
+	unsigned int pass)
 {
 	unsigned int index = get_global_id(0);
+	if (index >= num_sorted) return;
 
-	Particle_t particle = particles[index];
+	unsigned int partner = index ^ pass;
+	if (partner <= index) return;
 
-	bool hitting_bound = bounding(&particle);
+	bool ascending = (index & stage) == 0;
+	uint key = keys[index];
+	uint partner_key = keys[partner];
 
-	particle.velocity = (particle.predicted_pos - particle.position) * (1.0f / delta_time);
-	particle.position = particle.predicted_pos;
+	if ((key > partner_key) == ascending)
+	{
+		int value = order[index];
+		keys[index] = partner_key;
+		keys[partner] = key;
+		order[index] = order[partner];
+		order[partner] = value;
+	}
+}
 
-	particles[index].position = particle.position;
-	particles[index].velocity = particle.velocity;
+// gather particle fields and their side buffers into sorted order; prev_positions is left
+// as it is, the update of the step that follows rewrites it for every index
+__kernel void kernel_reorder(
+	__global const float4* restrict positions,
+	__global const float4* restrict velocities,
+	__global const float4* restrict predicted,
+	__global float4* restrict sorted_positions,
+	__global float4* restrict sorted_velocities,
+	__global float4* restrict sorted_predicted,
+	__global const float* restrict lambdas,
+	__global float* restrict sorted_lambdas,
+	__global const int* restrict ids,
+	__global int* restrict sorted_ids,
+	__global const int* restrict order,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	int source = order[index];
+	sorted_positions[index] = positions[source];
+	sorted_velocities[index] = velocities[source];
+	sorted_predicted[index] = predicted[source];
+	sorted_lambdas[index] = lambdas[source];
+	sorted_ids[index] = ids[source];
+}
+
+////////// render instances //////////
+
+// instance attributes written straight into the OpenGL instance buffer (CL/GL interop), one float4
+// per particle as ParticleInst in main.h: position alpha of the way through the last step in xyz, speed in w
+__kernel void kernel_fill_instances(
+	__global const float4* restrict positions,
+	__global const float4* restrict prev_positions,
+	__global const float4* restrict velocities,
+	__global float4* restrict instances,
+	float alpha,
+	unsigned int num_particles)
+{
+	unsigned int index = get_global_id(0);
+	if (index >= num_particles) return;
+
+	// size and speed color are derived in instancing.vert
+	float3 position = mix(prev_positions[index].xyz, positions[index].xyz, alpha);
+	instances[index] = (float4) (position, length(velocities[index].xyz));
 }
 
 ////////// fluid confinement //////////
 
 __kernel void kernel_viscosity(
-	__global Particle_t* particles,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table)
+	__global float4* restrict velocities,
+	__global const float4* restrict predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	unsigned int num_particles)
 {
 	unsigned int index = get_global_id(0);
-	unsigned int total = get_global_size(0);
+	if (index >= num_particles) return;
 
-	Particle_t particle = particles[index];
 	float3 viscosity = ((float3) {0.0f, 0.0f, 0.0f});
 
 	// confining vorticity: viscosity
-	//for (unsigned int i = 0; i < total; i++)
+	//for (unsigned int i = 0; i < num_particles; i++)
 	//{
 	//	if (neighboring(particle.predicted_pos, particles[i].predicted_pos, grid_div))
 	//	{
@@ -354,43 +1035,183 @@ __kernel void kernel_viscosity(
 	//	}
 	//}
 
-	particles[index].velocity += viscosity;
+	velocities[index] += (float4) (viscosity, 0.0f);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-int celling(float3 position)
+// cell containing position, clamped into the grid unless cells are hashed
+int3 cell_coord(float3 position)
 {
-	float div_x = (bb_sizes[BB_RIGHT] - bb_sizes[BB_LEFT])/ (float) grid_dim[GRID_X];
-	float div_y = (bb_sizes[BB_TOP] - bb_sizes[BB_BUTTOM])/ (float) grid_dim[GRID_Y];
-	float div_z = (bb_sizes[BB_FRONT] - bb_sizes[BB_BACK])/ (float) grid_dim[GRID_Z];
+	const float inv_cell = 1.0f / CELL_SIZE;
 
-	int cell_x = floor((position.x - bb_sizes[BB_LEFT]) / div_x);
-	int cell_y = floor((position.y - bb_sizes[BB_BUTTOM]) / div_y);
-	int cell_z = floor((position.z - bb_sizes[BB_BACK]) / div_z);
+	int cell_x = floor((position.x - BB_MIN_X) * inv_cell);
+	int cell_y = floor((position.y - BB_MIN_Y) * inv_cell);
+	int cell_z = floor((position.z - BB_MIN_Z) * inv_cell);
 
+#ifndef HASH_GRID
 	cell_x = clamp(cell_x, 0, grid_dim[GRID_X] - 1);
 	cell_y = clamp(cell_y, 0, grid_dim[GRID_Y] - 1);
 	cell_z = clamp(cell_z, 0, grid_dim[GRID_Z] - 1);
+#endif
+
+	return ((int3) {cell_x, cell_y, cell_z});
+}
+
+// slot of cell in the lookup table
+int cell_index(int3 cell)
+{
+#ifdef HASH_GRID
+	return cell_hash(cell_key(cell));
+#else
+	return cell_3to1(cell);
+#endif
+}
 
-	return cell_x + cell_y * grid_dim[GRID_X] + cell_z * grid_dim[GRID_X] * grid_dim[GRID_Y];
+int celling(float3 position)
+{
+	return cell_index(cell_coord(position));
 }
 
 bool out_of_grid(int3 cell)
 {
+#ifdef HASH_GRID
+	return false; // hashed grid is unbounded
+#else
 	return cell.x < 0 || cell.x >= grid_dim[GRID_X] ||
 		cell.y < 0 || cell.y >= grid_dim[GRID_Y] ||
 		cell.z < 0 || cell.z >= grid_dim[GRID_Z];
+#endif
+}
+
+// two neighbor cells may hash to the same slot, whose particles must then be visited only once;
+// records slot as the count-th visited one (particles of colliding cells are rejected by distance)
+bool slot_visited(int* visited, int count, int slot)
+{
+#ifdef HASH_GRID
+	for (int i = 0; i < count; i++)
+		if (visited[i] == slot) { visited[count] = -1; return true; }
+	visited[count] = slot;
+#endif
+	return false;
+}
+
+// inclusive scan of value across the work-group (Hillis-Steele); the total is left in scratch[lsize - 1]
+int2 scan_group(int2 value, __local int2* scratch)
+{
+	unsigned int lid = get_local_id(0);
+	unsigned int lsize = get_local_size(0);
+
+	scratch[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (unsigned int stride = 1; stride < lsize; stride <<= 1)
+	{
+		int2 other = (lid >= stride) ? scratch[lid - stride] : (int2) (0, 0);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += other;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	return scratch[lid];
+}
+
+// offsets and sizes of the 27 cells around cell, own cell first; returns their particle count
+int gather_neighborhood(int3 cell, __global const Lookup_t* cell_lookup, int* nbr_offset, int* nbr_size)
+{
+	int total = 0;
+
+	for (int i = 0; i < 27; i++)
+	{
+		int3 neighbor_cell = cell + grid_neighbors[i];
+		nbr_offset[i] = 0;
+		nbr_size[i] = 0;
+		if (out_of_grid(neighbor_cell)) continue;
+
+		int neighbor_cell_id = cell_3to1(neighbor_cell);
+		nbr_offset[i] = cell_lookup[neighbor_cell_id].offset;
+		nbr_size[i] = cell_lookup[neighbor_cell_id].size;
+		total += nbr_size[i];
+	}
+
+	return total;
+}
+
+// cooperatively copy neighborhood particles [first, first + count) to local memory,
+// predicted position in xyz and, if lambdas is given, lambda in w
+void load_neighborhood(
+	__local float4* neighbor_pos,
+	int first,
+	int count,
+	const int* nbr_offset,
+	const int* nbr_size,
+	__global const float4* predicted,
+	__global const int* cell_ptc_table,
+	__global const float* lambdas)
+{
+	for (int k = get_local_id(0); k < count; k += get_local_size(0))
+	{
+		int slot = first + k;
+		int i = 0;
+		while (slot >= nbr_size[i]) { slot -= nbr_size[i]; i++; }
+
+		int ptc_id = cell_ptc_table[nbr_offset[i] + slot];
+		float lambda = lambdas ? lambdas[ptc_id] : 0.0f;
+		neighbor_pos[k] = (float4) (predicted[ptc_id].xyz, lambda);
+	}
+}
+
+#ifdef HASH_GRID
+// 64-bit key of an unbounded cell, 21 bits per axis
+ulong cell_key(int3 cell)
+{
+	return ((ulong) (cell.x & 0x1FFFFF)) |
+		((ulong) (cell.y & 0x1FFFFF) << 21) |
+		((ulong) (cell.z & 0x1FFFFF) << 42);
+}
+
+// scramble key bits (splitmix64 finalizer) and fold into the table
+int cell_hash(ulong key)
+{
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9UL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebUL;
+	key ^= key >> 31;
+	return (int) (key % HASH_TABLE_SIZE);
+}
+#endif
+
+// interleave the low 10 bits of value with two zero bits each; the host turns reordering
+// off for grids of more than 1024 cells per axis, whose keys would alias
+uint morton_spread(uint value)
+{
+	value &= 0x3FF;
+	value = (value | (value << 16)) & 0x030000FF;
+	value = (value | (value << 8)) & 0x0300F00F;
+	value = (value | (value << 4)) & 0x030C30C3;
+	value = (value | (value << 2)) & 0x09249249;
+	return value;
+}
+
+// 30-bit Z-order key of a cell
+uint morton_key(int3 cell)
+{
+	return morton_spread(cell.x) | (morton_spread(cell.y) << 1) | (morton_spread(cell.z) << 2);
 }
 
+// write IDs of particles whose predicted position lies within radius of position, at most MAX_NEIGHBORS;
+// returns how many there are, more than were written when the list overflows
 int get_neighboring_particles(
-	int* particle_table,
+	__global int* particle_table,
 	float3 position,
-	__constant Lookup_t* cell_lookup,
-	__constant int* cell_ptc_table)
+	float radius,
+	__global const float4* predicted,
+	__global const Lookup_t* cell_lookup,
+	__global const int* cell_ptc_table)
 {
-	int cell_id = celling(position);
-	int3 cell = cell_1to3(cell_id);
+	int3 cell = cell_coord(position);
+	int visited[27];
 
 	int count = 0;
 
@@ -399,7 +1220,8 @@ int get_neighboring_particles(
 		int3 neighbor_cell = cell + grid_neighbors[i];
 		if (out_of_grid(neighbor_cell)) continue;
 
-		int neighbor_cell_id = cell_3to1(neighbor_cell);
+		int neighbor_cell_id = cell_index(neighbor_cell);
+		if (slot_visited(visited, i, neighbor_cell_id)) continue;
 
 		int offset = cell_lookup[neighbor_cell_id].offset;
 		int num_ptc = cell_lookup[neighbor_cell_id].size;
@@ -407,9 +1229,9 @@ int get_neighboring_particles(
 		for (int j = 0; j < num_ptc; j++)
 		{
 			int ptc_id = cell_ptc_table[offset + j];
-			particle_table[count] = ptc_id;
+			if (distance(position, predicted[ptc_id].xyz) > radius) continue;
+			if (count < MAX_NEIGHBORS) particle_table[count] = ptc_id;
 			count++;
-			if (count >= MAX_NEIGHBORS) { return count; }
 		}
 	}
 
@@ -435,17 +1257,13 @@ int cell_3to1(int3 cell)
 // detect if two particles is neighboring
 bool neighboring(float3 pos_1, float3 pos_2)
 {
-	float div_x = (bb_sizes[BB_RIGHT] - bb_sizes[BB_LEFT]) / (float) grid_dim[GRID_X];
-	float div_y = (bb_sizes[BB_TOP] - bb_sizes[BB_BUTTOM]) / (float) grid_dim[GRID_Y];
-	float div_z = (bb_sizes[BB_FRONT] - bb_sizes[BB_BACK]) / (float) grid_dim[GRID_Z];
+	int grid_X_1 = floor(pos_1.x / CELL_SIZE);
+	int grid_Y_1 = floor(pos_1.y / CELL_SIZE);
+	int grid_Z_1 = floor(pos_1.z / CELL_SIZE);
 
-	int grid_X_1 = floor(pos_1.x / div_x);
-	int grid_Y_1 = floor(pos_1.y / div_y);
-	int grid_Z_1 = floor(pos_1.z / div_z);
-
-	int grid_X_2 = floor(pos_2.x / div_x);
-	int grid_Y_2 = floor(pos_2.y / div_y);
-	int grid_Z_2 = floor(pos_2.z / div_z);
+	int grid_X_2 = floor(pos_2.x / CELL_SIZE);
+	int grid_Y_2 = floor(pos_2.y / CELL_SIZE);
+	int grid_Z_2 = floor(pos_2.z / CELL_SIZE);
 
 	if (abs(grid_X_1 - grid_X_2) <= 1)
 		if (abs(grid_Y_1 - grid_Y_2) <= 1)
@@ -491,26 +1309,26 @@ int hitting_face(float3 vec)
 }
 
 // perform bounding on fluid particles, reset whose params which exceed bound box
-bool bounding(Particle_t* particle)
+bool bounding(float3* predicted_pos)
 {
-	//float3 position = particle->position;
-	float3 velocity = particle->velocity;
-	float3 predicted_pos = particle->predicted_pos;
+	float3 position = *predicted_pos;
 
 	// detect bounding by predicted position
-	int face = hitting_face(predicted_pos);
+	float3 bb_min = ((float3) {BB_MIN_X, BB_MIN_Y, BB_MIN_Z});
+	float3 bb_max = ((float3) {BB_MAX_X, BB_MAX_Y, BB_MAX_Z});
 
-	if (face != -1)
+	if (any(position < bb_min) || any(position > bb_max))
 	{
+		//int face = hitting_face(predicted_pos);
 		//float eff_collide = 0.5f;
 		//float3 mask = ((float3) {1.0f, 1.0f, 1.0f});
 		//if (face == BB_RIGHT || face == BB_LEFT) mask.x = eff_collide;
 		//if (face == BB_TOP || face == BB_BUTTOM) mask.y = eff_collide;
 		//if (face == BB_FRONT || face == BB_BACK) mask.z = eff_collide;
 		//particle->velocity = mask * reflect(velocity, bb_normals[face]);
-		particle->predicted_pos.x = clamp(predicted_pos.x, bb_sizes[BB_LEFT], bb_sizes[BB_RIGHT]);
-		particle->predicted_pos.y = clamp(predicted_pos.y, bb_sizes[BB_BUTTOM], bb_sizes[BB_TOP]);
-		particle->predicted_pos.z = clamp(predicted_pos.z, bb_sizes[BB_BACK], bb_sizes[BB_FRONT]);
+		predicted_pos->x = clamp(position.x, bb_sizes[BB_LEFT], bb_sizes[BB_RIGHT]);
+		predicted_pos->y = clamp(position.y, bb_sizes[BB_BUTTOM], bb_sizes[BB_TOP]);
+		predicted_pos->z = clamp(position.z, bb_sizes[BB_BACK], bb_sizes[BB_FRONT]);
 		return true;
 	} return false;
 }
@@ -564,3 +1382,94 @@ float3 w_grad_spiky(float3 position, float div)
 	core = -ct * core / (div4 * (radius + kEpsilon));
 	return position * core;
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// apply external force to the velocity of particle index, and return its predicted position
+float3 apply_external_force(
+	__global const float4* restrict positions,
+	__global float4* restrict velocities,
+	unsigned int index,
+	float dt)
+{
+	// perform external force on particle
+	float3 velocity = velocities[index].xyz;
+	velocity.y += -gravity_accer * dt * mass;
+	velocities[index] = (float4) (velocity, 0.0f);
+
+	// predict position only affected by external forces
+	return positions[index].xyz + velocity * dt;
+}
+
+// predicted position of particle index corrected by its neighbors' lambdas
+float3 displace(
+	__global const float4* predicted,
+	__global const Lookup_t* restrict cell_lookup,
+	__global const int* restrict cell_ptc_table,
+	__global const float* restrict lambdas,
+	unsigned int index)
+{
+	float3 predicted_pos = predicted[index].xyz;
+	float lambda = lambdas[index];
+
+	float3 displacement = ((float3) {0.0f,  0.0f,  0.0f});
+
+	//for (unsigned int i = 0; i < num_particles; i++)
+	//{
+	//	if (neighboring(particle.position, particles[i].position))
+	//	{
+	//		float3 position = particle.predicted_pos - particles[i].predicted_pos;
+	//		float s_corr = 0.0f;
+	//		//s_corr = w_spiky(length(position), cutoff) / w_spiky(0.1f * cutoff, cutoff);
+	//		//s_corr = -0.0001f * pow(s_corr, 4);
+	//		displacement += w_grad_spiky(position, cutoff) * (lambda + lambdas[i] + s_corr);
+	//	}
+	//}
+
+	int3 cell = cell_coord(predicted_pos);
+	int visited[27];
+	for (int i = 0; i < 27; i++)
+	{
+		int3 neighbor_cell = cell + grid_neighbors[i];
+		if (out_of_grid(neighbor_cell)) continue;
+		int neighbor_cell_id = cell_index(neighbor_cell);
+		if (slot_visited(visited, i, neighbor_cell_id)) continue;
+		int offset = cell_lookup[neighbor_cell_id].offset;
+		int num_ptc = cell_lookup[neighbor_cell_id].size;
+		for (int j = 0; j < num_ptc; j++)
+		{
+			int ptc_id = cell_ptc_table[offset + j];
+			float3 position = predicted_pos - predicted[ptc_id].xyz;
+			float s_corr = 0.0f;
+			s_corr = w_spiky(length(position), cutoff) / w_spiky(0, cutoff);
+			s_corr = -0.01f * pow(s_corr, 4);
+			displacement += w_grad_spiky(position, cutoff) * (lambda + lambdas[ptc_id] + s_corr);
+		}
+	}
+
+	predicted_pos += displacement;
+
+	bounding(&predicted_pos);
+
+	return predicted_pos / density_water;
+}
+
+// move particle index to its corrected position, and derive its velocity
+void update_particle(
+	__global float4* restrict positions,
+	__global float4* restrict velocities,
+	__global float4* restrict prev_positions,
+	float3 predicted_pos,
+	unsigned int index,
+	float dt)
+{
+	bounding(&predicted_pos);
+
+	float4 position = positions[index];
+	float3 velocity = (predicted_pos - position.xyz) * (1.0f / dt);
+
+	// keep the state before the step, rendering interpolates between the two
+	prev_positions[index] = position;
+	positions[index] = (float4) (predicted_pos, 0.0f);
+	velocities[index] = (float4) (velocity, 0.0f);
+}
@@ -0,0 +1,23 @@
+#ifndef PARTICLE_LAYOUT_H
+#define PARTICLE_LAYOUT_H
+
+/** ParticleLayout.h: particle storage shared by the host (Fluid.h) and the kernels (Particle.cl) */
+
+// Particle state is a structure of arrays, one buffer per field (position, velocity, predicted
+// position), each holding one float4 per particle: the vector in xyz, w free for a per-particle
+// scalar. A kernel binds only the fields it touches.
+#define PARTICLE_FIELD_SIZE 16
+
+// for rapid mapping cell IDs table to particles table
+typedef struct __Lookup_t
+{
+	int offset;
+	int size;
+} Lookup_t;
+
+#define LOOKUP_SIZE 8
+
+// OpenCL C has no static_assert, a negative array size fails both compilers instead
+typedef char lookup_size_check[(sizeof(Lookup_t) == LOOKUP_SIZE) ? 1 : -1];
+
+#endif
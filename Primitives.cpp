@@ -179,7 +179,8 @@ Quad :: Quad() {
 *
 *************************************************/
 
-Base3D :: Base3D() {
+Base3D :: Base3D() :
+index_offset(0) {
 	//position = glm::vec3(0.0f, 0.0f, 0.0f);
 	//scale    = glm::vec3(1.0f, 1.0f, 1.0f);
 	//rotation = glm::mat4(1.0f);
@@ -270,7 +271,7 @@ void Base3D :: Draw(Shader & shader) {
 
 	// Draw mesh
 	glBindVertexArray(vao);
-	glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+	glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, (void*)index_offset);
 	glBindVertexArray(0);
 
 	glActiveTexture(GL_TEXTURE0);
@@ -469,6 +470,10 @@ std::vector<glm::vec3> TrCube :: FaceCenters = {
 	{ 0.0, -0.5,  0.0}, // buttom
 };
 
+TrCube :: TrCube() :
+index_stream(cube_elements.size() * sizeof(GLuint)) {
+}
+
 void TrCube :: UpdateRenderOrder(glm::vec3 & camPos, glm::mat4 & modelMatrix) {
 
 	std::map<float, int> distdict;
@@ -494,8 +499,12 @@ void TrCube :: UpdateRenderOrder(glm::vec3 & camPos, glm::mat4 & modelMatrix) {
 			indices.push_back(e + face_id * 4);
 	}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+	// stream the order instead of reallocating ebo, and draw from the region just written
+	index_offset = index_stream.Write(indices.data(), indices.size() * sizeof(GLuint));
+
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_stream.Buffer());
+	glBindVertexArray(0);
 }
 
 /**
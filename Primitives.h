@@ -4,6 +4,7 @@
 #include <Shader.h>
 #include <Texture.h>
 #include <Mesh.h>
+#include <StreamBuffer.h>
 
 #include <glad/glad.h>
 #include <glm/glm.hpp>
@@ -95,6 +96,7 @@ public:
 protected:
 	/** Render Data */
 	unsigned int vbo, ebo, vao;
+	GLintptr index_offset; // byte offset of indices in the element buffer bound to vao
 
 	/** Geometry params 
 	glm::vec3 position;
@@ -133,9 +135,14 @@ protected:
 class TrCube : public Cube {
 public:
 	/** Methods */
+	TrCube();
+
 	void UpdateRenderOrder(glm::vec3 & camPos, glm::mat4 & modelMatrix);
 
 protected:
+	/** Render Data */
+	StreamBuffer index_stream; // face indices sorted back to front, respecified on every update
+
 	//enum FaceDir { FRONT, BACK, LEFT, RIGHT, TOP, BUTTOM };
 	static std::vector<glm::vec3> FaceCenters;
 };
@@ -0,0 +1,171 @@
+#include "Profiler.h"
+
+#include <algorithm>
+
+/** Namespace */
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// Rolling statistics
+//-----------------------------------------------------------------------------
+
+double Profiler::Stage::min() const
+{
+	return window.empty() ? 0.0 : *std::min_element(window.begin(), window.end());
+}
+
+static double mean(const deque<double> & values)
+{
+	double sum = 0.0;
+	for (double value : values) sum += value;
+	return values.empty() ? 0.0 : sum / values.size();
+}
+
+double Profiler::Stage::avg() const
+{
+	return mean(window);
+}
+
+double Profiler::Stage::submitDelay() const
+{
+	return mean(submit_delays);
+}
+
+double Profiler::Stage::startDelay() const
+{
+	return mean(start_delays);
+}
+
+double Profiler::Stage::p99() const
+{
+	if (window.empty()) return 0.0;
+
+	vector<double> sorted(window.begin(), window.end());
+	std::size_t rank = (std::size_t) (0.99 * (sorted.size() - 1) + 0.5);
+	std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+	return sorted[rank];
+}
+
+//-----------------------------------------------------------------------------
+// Tagging
+//-----------------------------------------------------------------------------
+
+Profiler::Profiler(std::size_t window_size) :
+	window_size(window_size)
+{
+}
+
+cl::Event* Profiler::tag(const char* stage, int kernel)
+{
+	if (!enabled) return NULL;
+
+	pending.push_back(Tagged());
+	pending.back().stage = stage;
+	pending.back().kernel = kernel;
+	return &pending.back().event;
+}
+
+void Profiler::record(const char* stage, const cl::Event & event, int kernel)
+{
+	cl::Event* tagged = tag(stage, kernel);
+	if (tagged) *tagged = event;
+}
+
+void Profiler::collect(bool wait)
+{
+	// in-order queue: everything tagged is done once the last command is
+	if (wait && !pending.empty() && pending.back().event())
+		pending.back().event.wait();
+
+	while (!pending.empty()) {
+
+		Tagged & tagged = pending.front();
+
+		// tagged but never enqueued (a failed enqueue leaves the event empty)
+		if (!tagged.event()) { pending.pop_front(); continue; }
+
+		if (tagged.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+			if (!wait) break;
+			tagged.event.wait();
+		}
+
+		cl_ulong queued = tagged.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		cl_ulong submit = tagged.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		cl_ulong start = tagged.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		cl_ulong end = tagged.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		double ms = (end - start) * 1e-6;
+
+		Stage & stage = stage_stats[tagged.stage];
+		stage.window.push_back(ms);
+		stage.submit_delays.push_back((submit - queued) * 1e-6);
+		stage.start_delays.push_back((start - submit) * 1e-6);
+		if (stage.window.size() > window_size) {
+			stage.window.pop_front();
+			stage.submit_delays.pop_front();
+			stage.start_delays.pop_front();
+		}
+		stage.total_ms += ms;
+		stage.calls++;
+
+		if (tagged.kernel >= 0) {
+			if (kernel_ms.size() <= (std::size_t) tagged.kernel) kernel_ms.resize(tagged.kernel + 1, 0.0);
+			kernel_ms[tagged.kernel] += ms;
+		}
+
+		pending.pop_front();
+	}
+}
+
+void Profiler::reset()
+{
+	collect();
+	stage_stats.clear();
+	kernel_ms.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Reports
+//-----------------------------------------------------------------------------
+
+void Profiler::report(ostream & out) const
+{
+	double total = 0.0;
+	for (auto & stage : stage_stats) total += stage.second.total_ms;
+
+	out << "stage, calls, total ms, share, min ms, avg ms, p99 ms, queued to submit ms, submit to start ms\n";
+	for (auto & entry : stage_stats) {
+		const Stage & stage = entry.second;
+		out << entry.first << ", " << stage.calls << ", " << stage.total_ms << ", "
+			<< (total > 0.0 ? 100.0 * stage.total_ms / total : 0.0) << "%, "
+			<< stage.min() << ", " << stage.avg() << ", " << stage.p99() << ", "
+			<< stage.submitDelay() << ", " << stage.startDelay() << "\n";
+	}
+}
+
+bool Profiler::openLog(const string & filename)
+{
+	log_file.open(filename, std::ios::out | std::ios::trunc);
+	if (!log_file) { cerr << "Cannot write profile: " << filename << "\n"; return false; }
+
+	json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+	if (!json) log_file << "time_s,stage,calls,total_ms,min_ms,avg_ms,p99_ms,submit_delay_ms,start_delay_ms\n";
+	return true;
+}
+
+void Profiler::log(double seconds)
+{
+	if (!log_file.is_open()) return;
+
+	for (auto & entry : stage_stats) {
+		const Stage & stage = entry.second;
+		if (json)
+			log_file << "{\"time_s\": " << seconds << ", \"stage\": \"" << entry.first << "\", \"calls\": " << stage.calls
+				<< ", \"total_ms\": " << stage.total_ms << ", \"min_ms\": " << stage.min() << ", \"avg_ms\": " << stage.avg()
+				<< ", \"p99_ms\": " << stage.p99() << ", \"submit_delay_ms\": " << stage.submitDelay()
+				<< ", \"start_delay_ms\": " << stage.startDelay() << "}\n";
+		else
+			log_file << seconds << "," << entry.first << "," << stage.calls << "," << stage.total_ms << ","
+				<< stage.min() << "," << stage.avg() << "," << stage.p99() << "," << stage.submitDelay() << "," << stage.startDelay() << "\n";
+	}
+	log_file.flush();
+}
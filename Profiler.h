@@ -0,0 +1,78 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <fstream>
+
+#include "cl.h"
+
+// Timestamps of commands enqueued on a queue created with CL_QUEUE_PROFILING_ENABLE,
+// grouped by stage name (binning, lambda, readback, ...). Keeps a rolling window of
+// durations per stage for min / avg / p99, and totals since reset().
+class Profiler {
+
+public:
+	/** Per-stage statistics */
+	struct Stage
+	{
+		std::deque<double> window; // last durations, ms
+		std::deque<double> submit_delays; // queued to submitted of the same commands, ms: host side
+		std::deque<double> start_delays; // submitted to start, ms: waiting on the device
+		double total_ms = 0.0;
+		unsigned long calls = 0;
+
+		double min() const;
+		double avg() const;
+		double p99() const;
+		double submitDelay() const;
+		double startDelay() const;
+	};
+
+	bool enabled = false;
+
+	/** Methods */
+	explicit Profiler(std::size_t window_size = 512);
+
+	// Event for the next command of stage to signal, NULL when disabled; kernel is the
+	// index of the kernel for per-kernel totals, -1 for transfers
+	cl::Event* tag(const char* stage, int kernel = -1);
+	// Same for a command enqueued with an event of the caller's
+	void record(const char* stage, const cl::Event & event, int kernel = -1);
+
+	// Fold timestamps of tagged commands into the statistics; without wait, only of
+	// those complete so far, and never blocking
+	void collect(bool wait = true);
+
+	void reset(); // clear statistics and totals
+
+	const std::map<std::string, Stage> & stages() const { return stage_stats; }
+	const std::vector<double> & kernelTotals() const { return kernel_ms; } // ms per kernel index
+
+	// Table of stages to out
+	void report(std::ostream & out) const;
+
+	// Append one row per stage to filename: CSV, or JSON lines when it ends in .json
+	bool openLog(const std::string & filename);
+	void log(double seconds);
+
+private:
+	struct Tagged
+	{
+		std::string stage;
+		int kernel;
+		cl::Event event;
+	};
+
+	std::size_t window_size;
+	std::deque<Tagged> pending; // deque: tag() hands out pointers into it
+	std::map<std::string, Stage> stage_stats;
+	std::vector<double> kernel_ms;
+
+	std::ofstream log_file;
+	bool json = false;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "ReferenceSolver.h"
+#include "SolverMath.h"
+
+#include <cmath>
+#include <algorithm>
+
+/** Namespace */
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// Smoothing kernels, as in Particle.cl
+//-----------------------------------------------------------------------------
+
+static float w_spiky(float radius, float div)
+{
+	if (radius > div) return 0.0f;
+	float ct = 15.0f / kPi;
+	float div3 = pow(div, 3.0f);
+	float core = radius / div;
+	core = 1.0f - core;
+	core = core * core * core;
+	return ct * core / div3;
+}
+
+static glm::vec3 w_grad_spiky(const glm::vec3 & position, float div)
+{
+	float radius = glm::length(position);
+	if (radius > div) return glm::vec3(0.0f);
+	float ct = 45.0f / kPi;
+	float div4 = pow(div, 4.0f);
+	float core = radius / div;
+	core = 1.0f - core;
+	core = core * core;
+	core = -ct * core / (div4 * (radius + kEpsilon));
+	return position * core;
+}
+
+//-----------------------------------------------------------------------------
+// Constructor
+//-----------------------------------------------------------------------------
+
+ReferenceSolver::ReferenceSolver(const FluidConfig & config) :
+	Solver(config),
+	cell_size(config.cellSize()),
+	grid_dim(config.gridDim())
+{
+	unsigned int cnt_obj = config.num_particles;
+
+	positions.assign(cnt_obj, glm::vec4(0.0f));
+	prev_positions.assign(cnt_obj, glm::vec4(0.0f));
+	velocities.assign(cnt_obj, glm::vec4(0.0f));
+	predicted.assign(cnt_obj, glm::vec4(0.0f));
+	corrected.assign(cnt_obj, glm::vec4(0.0f));
+	lambdas.assign(cnt_obj, 0.0f);
+
+	cell_ids.resize(cnt_obj);
+	cell_table.resize(cnt_obj);
+	cell_offsets.resize(grid_dim.x * grid_dim.y * grid_dim.z + 1);
+}
+
+//-----------------------------------------------------------------------------
+// Initial particles: the lattice column, or given ones. A checkpoint in config
+// is not read; to resume, pass the OpenCL solver's particles to setParticles.
+//-----------------------------------------------------------------------------
+
+void ReferenceSolver::initParticles()
+{
+	initLattice();
+	restart();
+}
+
+void ReferenceSolver::setParticles(const vector<glm::vec4> & new_positions, const vector<glm::vec4> & new_velocities)
+{
+	std::copy(new_positions.begin(), new_positions.begin() + size(), positions.begin());
+	std::copy(new_velocities.begin(), new_velocities.begin() + size(), velocities.begin());
+	restart();
+}
+
+// at rest since the last step
+void ReferenceSolver::restart()
+{
+	prev_positions = positions;
+	std::fill(lambdas.begin(), lambdas.end(), 0.0f);
+	step_count = 0;
+}
+
+void ReferenceSolver::readLambdas(vector<float> & lambdas)
+{
+	lambdas = this->lambdas;
+}
+
+//-----------------------------------------------------------------------------
+// Advance the fluid by one time step, pass for pass as Fluid::simulate on the
+// per-particle path. Displacements read the positions of the previous pass
+// (Jacobi); kernel_calc_disp overwrites them in place, so on the device a
+// particle may already see some of its neighbors moved.
+//-----------------------------------------------------------------------------
+
+void ReferenceSolver::simulate(float dt)
+{
+	unsigned int cnt_obj = config.num_particles;
+	step_count++;
+
+	// apply external force and predict positions (kernel_externel_force)
+	for (unsigned int i = 0; i < cnt_obj; i++) {
+		glm::vec3 velocity = glm::vec3(velocities[i]);
+		velocity.y += -config.gravity * dt * config.mass;
+		velocities[i] = glm::vec4(velocity, 0.0f);
+		predicted[i] = glm::vec4(glm::vec3(positions[i]) + velocity * dt, 0.0f);
+	}
+
+	// cells stay those of the predicted positions for all iterations, as on the device
+	binParticles();
+
+	// solve constrain equation
+	unsigned int num_iteration = 5;
+	for (unsigned int iter = 0; iter < num_iteration; iter++) {
+		for (unsigned int i = 0; i < cnt_obj; i++)
+			lambdas[i] = calcLambda(i);
+		for (unsigned int i = 0; i < cnt_obj; i++)
+			corrected[i] = glm::vec4(displace(i), 0.0f);
+		predicted.swap(corrected);
+	}
+
+	// update particle (kernel_update)
+	for (unsigned int i = 0; i < cnt_obj; i++) {
+		glm::vec3 predicted_pos = glm::vec3(predicted[i]);
+		bounding(predicted_pos);
+
+		glm::vec3 velocity = (predicted_pos - glm::vec3(positions[i])) * (1.0f / dt);
+
+		prev_positions[i] = positions[i];
+		positions[i] = glm::vec4(predicted_pos, 0.0f);
+		velocities[i] = glm::vec4(velocity, 0.0f);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Dense grid anchored at the bound box min corner, coordinates clamped into it
+//-----------------------------------------------------------------------------
+
+glm::ivec3 ReferenceSolver::cellCoord(const glm::vec3 & position) const
+{
+	glm::ivec3 cell = glm::ivec3(glm::floor((position - config.bb_min) * (1.0f / cell_size)));
+	return glm::clamp(cell, glm::ivec3(0), grid_dim - 1);
+}
+
+int ReferenceSolver::cellIndex(const glm::ivec3 & cell) const
+{
+	return (cell.z * grid_dim.y + cell.y) * grid_dim.x + cell.x;
+}
+
+int ReferenceSolver::neighborCells(const glm::vec3 & position, int* cells) const
+{
+	glm::ivec3 cell = cellCoord(position);
+	glm::ivec3 lo = glm::max(cell - 1, glm::ivec3(0));
+	glm::ivec3 hi = glm::min(cell + 1, grid_dim - 1);
+
+	int count = 0;
+	for (int z = lo.z; z <= hi.z; z++)
+		for (int y = lo.y; y <= hi.y; y++)
+			for (int x = lo.x; x <= hi.x; x++)
+				cells[count++] = cellIndex(glm::ivec3(x, y, z));
+	return count;
+}
+
+// counting sort of particle IDs by cell of their predicted position
+void ReferenceSolver::binParticles()
+{
+	unsigned int cnt_obj = config.num_particles;
+
+	std::fill(cell_offsets.begin(), cell_offsets.end(), 0);
+	for (unsigned int i = 0; i < cnt_obj; i++) {
+		cell_ids[i] = cellIndex(cellCoord(glm::vec3(predicted[i])));
+		cell_offsets[cell_ids[i] + 1]++;
+	}
+
+	for (std::size_t c = 1; c < cell_offsets.size(); c++)
+		cell_offsets[c] += cell_offsets[c - 1];
+
+	vector<int> next(cell_offsets.begin(), cell_offsets.end() - 1);
+	for (unsigned int i = 0; i < cnt_obj; i++)
+		cell_table[next[cell_ids[i]]++] = i;
+}
+
+//-----------------------------------------------------------------------------
+// Internel forces (kernel_calc_lambda and displace in Particle.cl)
+//-----------------------------------------------------------------------------
+
+float ReferenceSolver::calcLambda(unsigned int index) const
+{
+	glm::vec3 predicted_pos = glm::vec3(predicted[index]);
+	float cutoff = config.cutoff;
+
+	float numerator = 0.0f;
+	float denominator = 1.0f * kEpsilon;
+	float ct = -0.00243f * kPi * config.density * pow(cutoff, 5.0f);
+	glm::vec3 self_grad = glm::vec3(0.0f);
+
+	int cells[27];
+	int num_cells = neighborCells(predicted_pos, cells);
+	for (int c = 0; c < num_cells; c++) {
+		for (int slot = cell_offsets[cells[c]]; slot < cell_offsets[cells[c] + 1]; slot++) {
+			glm::vec3 position = predicted_pos - glm::vec3(predicted[cell_table[slot]]);
+			float radius = glm::length(position);
+			if (radius > cutoff) continue;
+			float ratio = radius / cutoff;
+			numerator += config.mass * pow(1.0f - ratio * ratio, 3.0f);
+			float inter_grad_scale = pow(1.0f - ratio, 4.0f);
+			denominator += inter_grad_scale;
+			// OpenCL normalize() leaves a zero vector as it is
+			if (radius > 0.0f) self_grad += inter_grad_scale * (position / radius);
+		}
+	}
+
+	denominator += glm::dot(self_grad, self_grad);
+
+	return ct * (numerator / config.density - 1.0f) / denominator;
+}
+
+glm::vec3 ReferenceSolver::displace(unsigned int index) const
+{
+	glm::vec3 predicted_pos = glm::vec3(predicted[index]);
+	float lambda = lambdas[index];
+	float cutoff = config.cutoff;
+
+	glm::vec3 displacement = glm::vec3(0.0f);
+
+	int cells[27];
+	int num_cells = neighborCells(predicted_pos, cells);
+	for (int c = 0; c < num_cells; c++) {
+		for (int slot = cell_offsets[cells[c]]; slot < cell_offsets[cells[c] + 1]; slot++) {
+			int ptc_id = cell_table[slot];
+			glm::vec3 position = predicted_pos - glm::vec3(predicted[ptc_id]);
+			float s_corr = w_spiky(glm::length(position), cutoff) / w_spiky(0, cutoff);
+			s_corr = -0.01f * pow(s_corr, 4.0f);
+			displacement += w_grad_spiky(position, cutoff) * (lambda + lambdas[ptc_id] + s_corr);
+		}
+	}
+
+	predicted_pos += displacement;
+
+	bounding(predicted_pos);
+
+	return predicted_pos / config.density;
+}
+
+// clamp into the bound box, true when position was outside
+bool ReferenceSolver::bounding(glm::vec3 & position) const
+{
+	if (glm::any(glm::lessThan(position, config.bb_min)) || glm::any(glm::greaterThan(position, config.bb_max))) {
+		position = glm::clamp(position, config.bb_min, config.bb_max);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,54 @@
+#ifndef REFERENCE_SOLVER_H
+#define REFERENCE_SOLVER_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Fluid.h"
+
+// Scalar C++ port of the per-particle solver in Particle.cl: same kernels, s_corr, bounding and
+// constraint iterations, one particle after the other on the calling thread. It serves as the
+// ground truth the OpenCL solver is compared with (fluid_compare.exe), not as a fast path.
+// Cells always come from the dense grid over the bound box, whatever the hash and skin settings;
+// the neighbors found within cutoff are the same.
+class ReferenceSolver : public Solver {
+
+public:
+	/** Lambdas of the last constraint iteration */
+	std::vector<float> lambdas;
+
+	/** Methods */
+	ReferenceSolver(const FluidConfig & config);
+
+	void initParticles();
+	void setParticles(const std::vector<glm::vec4> & positions, const std::vector<glm::vec4> & velocities);
+	using Solver::simulate;
+	void simulate(float dt); // the whole step, done when it returns
+	void finish() {}
+	void readParticles() {} // host arrays are the solver's own
+	void readLambdas(std::vector<float> & lambdas);
+
+private:
+	std::vector<glm::vec4> predicted;
+	std::vector<glm::vec4> corrected; // displaced positions, swapped with predicted after each pass
+
+	/** Dense grid, particle IDs sorted by cell */
+	float cell_size;
+	glm::ivec3 grid_dim;
+	std::vector<int> cell_ids;
+	std::vector<int> cell_offsets; // first slot of each cell in cell_table, plus one past the last
+	std::vector<int> cell_table;
+
+	/** Methods */
+	void restart();
+	glm::ivec3 cellCoord(const glm::vec3 & position) const;
+	int cellIndex(const glm::ivec3 & cell) const;
+	int neighborCells(const glm::vec3 & position, int* cells) const; // up to 27 cells, returns how many
+	void binParticles();
+	float calcLambda(unsigned int index) const;
+	glm::vec3 displace(unsigned int index) const;
+	bool bounding(glm::vec3 & position) const;
+};
+
+#endif
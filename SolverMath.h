@@ -0,0 +1,9 @@
+#ifndef SOLVER_MATH_H
+#define SOLVER_MATH_H
+
+/** SolverMath.h: constant math of Particle.cl, for the host solvers (ReferenceSolver, NativeSolver) */
+
+const float kEpsilon = 1e-3f;
+const float kPi = 3.14159265f;
+
+#endif
@@ -0,0 +1,111 @@
+#include <StreamBuffer.h>
+
+#include <glad/glad.h>
+
+#include <cstring>
+#include <vector>
+
+StreamBuffer :: StreamBuffer(GLsizeiptr region_size, unsigned int num_regions) :
+region_size(region_size), num_regions(num_regions), region(0), written(false), mapped(NULL) {
+
+	setup();
+}
+
+StreamBuffer :: ~StreamBuffer() {
+	release();
+}
+
+void StreamBuffer :: setup() {
+
+	GLsizeiptr total = region_size * num_regions;
+	fences.assign(num_regions, 0);
+
+	// the copy-write target leaves array, element array and vertex array bindings alone
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+
+	if (GLAD_GL_VERSION_4_4) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_WRITE_BUFFER, total, NULL, flags);
+		mapped = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, total, flags);
+
+		// immutable storage cannot be respecified, start over with a plain buffer
+		if (!mapped) {
+			glDeleteBuffers(1, &buffer);
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		}
+	}
+
+	if (!mapped)
+		glBufferData(GL_COPY_WRITE_BUFFER, total, NULL, GL_STREAM_DRAW);
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void StreamBuffer :: release() {
+
+	for (GLsync & fence : fences) {
+		if (fence) glDeleteSync(fence);
+		fence = 0;
+	}
+
+	if (mapped) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		mapped = NULL;
+	}
+
+	glDeleteBuffers(1, &buffer);
+}
+
+GLintptr StreamBuffer :: Write(const void* data, GLsizeiptr size) {
+
+	// grow regions to fit; draws still reading the old storage keep it alive in the driver
+	if (size > region_size) {
+		release();
+		region_size = size;
+		written = false;
+		setup();
+	}
+
+	bool fenced = glFenceSync != NULL;
+
+	// draws issued since the last write read the region it filled
+	if (written && fenced)
+		fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	region = written ? (region + 1) % num_regions : 0;
+	written = true;
+	GLintptr offset = region * region_size;
+
+	if (fenced) waitRegion(region);
+
+	if (mapped) {
+		std::memcpy(static_cast<char*>(mapped) + offset, data, size);
+		return offset;
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	// without fences, orphan the storage on every wrap so the driver hands out fresh memory
+	if (!fenced && region == 0)
+		glBufferData(GL_COPY_WRITE_BUFFER, region_size * num_regions, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	return offset;
+}
+
+void StreamBuffer :: waitRegion(unsigned int i) {
+
+	if (!fences[i]) return;
+
+	// flush on the first try, so that the fence is sure to reach the GPU
+	GLenum status = glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	while (status == GL_TIMEOUT_EXPIRED)
+		status = glClientWaitSync(fences[i], 0, 1000000); // 1 ms
+
+	glDeleteSync(fences[i]);
+	fences[i] = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <vector>
+
+#include <glad/glad.h>
+
+// Buffer for data respecified every frame (instances, sorted indices): a ring of regions, each
+// written while the GPU may still read the others. Persistently mapped where GL 4.4 buffer storage
+// is available, else filled with glBufferSubData after a fence confirms the region is free, else
+// orphaned when fences are missing too.
+class StreamBuffer {
+public:
+	/** Methods */
+	StreamBuffer(GLsizeiptr region_size, unsigned int num_regions = 3);
+	~StreamBuffer();
+
+	StreamBuffer(const StreamBuffer &) = delete;
+	StreamBuffer & operator = (const StreamBuffer &) = delete;
+
+	// Copy size bytes into the next region and return its byte offset in Buffer(), for
+	// glVertexAttribPointer or glDrawElements. Draws issued since the previous Write
+	// are taken as the readers of the previous region.
+	GLintptr Write(const void* data, GLsizeiptr size);
+
+	GLuint Buffer() const { return buffer; }
+
+private:
+	/** Render Data */
+	GLuint buffer;
+	GLsizeiptr region_size;
+	unsigned int num_regions;
+	unsigned int region; // last region written
+	bool written;
+
+	void* mapped; // persistent mapping, NULL when unavailable
+	std::vector<GLsync> fences; // one per region, 0 when free
+
+	/** Methods */
+	void setup();
+	void release();
+	void waitRegion(unsigned int i);
+};
+
+#endif
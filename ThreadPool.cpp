@@ -0,0 +1,130 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+/** Namespace */
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// Start num_threads - 1 workers, the caller of parallelFor being the last one
+//-----------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(unsigned int num_threads) :
+	remaining(0),
+	num_steals(0)
+{
+	if (num_threads == 0) num_threads = std::max(1u, thread::hardware_concurrency());
+
+	for (unsigned int i = 0; i < num_threads; i++)
+		queues.emplace_back(new Queue());
+
+	for (unsigned int i = 1; i < num_threads; i++)
+		threads.emplace_back(&ThreadPool::worker, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(job_mutex);
+		stopping = true;
+	}
+	job_start.notify_all();
+
+	for (thread & worker : threads) worker.join();
+}
+
+//-----------------------------------------------------------------------------
+// Deal the tasks of a job, work on it, and wait for the tasks others stole
+//-----------------------------------------------------------------------------
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const Body & body)
+{
+	if (count == 0) return;
+
+	grain = std::max<size_t>(grain, 1);
+	size_t num_tasks = (count + grain - 1) / grain;
+
+	// not worth waking anyone
+	if (num_tasks == 1) { body(0, count); return; }
+
+	this->body = &body;
+	remaining = num_tasks;
+
+	// worker w owns the w-th contiguous run of tasks
+	size_t num_queues = queues.size();
+	for (size_t w = 0; w < num_queues; w++) {
+		lock_guard<mutex> lock(queues[w]->mutex);
+		for (size_t t = num_tasks * w / num_queues; t < num_tasks * (w + 1) / num_queues; t++)
+			queues[w]->tasks.push_back({ t * grain, std::min(count, (t + 1) * grain) });
+	}
+
+	{
+		lock_guard<mutex> lock(job_mutex);
+		generation++;
+	}
+	job_start.notify_all();
+
+	while (runTask(0)) {}
+
+	unique_lock<mutex> lock(job_mutex);
+	job_done.wait(lock, [this] { return remaining == 0; });
+}
+
+//-----------------------------------------------------------------------------
+// Workers sleep between jobs and drain the queues while one runs
+//-----------------------------------------------------------------------------
+
+void ThreadPool::worker(unsigned int self)
+{
+	unsigned long seen = 0;
+
+	for (;;) {
+		{
+			unique_lock<mutex> lock(job_mutex);
+			job_start.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+		}
+
+		while (runTask(self)) {}
+	}
+}
+
+bool ThreadPool::runTask(unsigned int self)
+{
+	Task task;
+	bool found = false;
+
+	// own tasks in order, from the front
+	{
+		Queue & own = *queues[self];
+		lock_guard<mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = own.tasks.front();
+			own.tasks.pop_front();
+			found = true;
+		}
+	}
+
+	// steal from the back, the tasks the owner would reach last
+	for (size_t k = 1; !found && k < queues.size(); k++) {
+		Queue & victim = *queues[(self + k) % queues.size()];
+		lock_guard<mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.back();
+			victim.tasks.pop_back();
+			found = true;
+			num_steals++;
+		}
+	}
+
+	if (!found) return false;
+
+	(*body)(task.first, task.last);
+
+	if (--remaining == 0) {
+		lock_guard<mutex> lock(job_mutex);
+		job_done.notify_all();
+	}
+	return true;
+}
@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool with work stealing. parallelFor cuts a range into tasks and deals each worker
+// a contiguous run of them, so neighboring tasks (and the data they touch) stay on one core.
+// A worker takes tasks from the front of its own queue; once it runs dry it steals from the
+// back of the others'. The calling thread works as worker 0 and returns when all tasks are done.
+class ThreadPool {
+
+public:
+	typedef std::function<void(std::size_t first, std::size_t last)> Body;
+
+	ThreadPool(unsigned int num_threads = 0); // 0: one per hardware thread
+	~ThreadPool();
+
+	// body(first, last) over [0, count) in tasks of grain indices, the last one shorter
+	void parallelFor(std::size_t count, std::size_t grain, const Body & body);
+
+	unsigned int size() const { return (unsigned int) queues.size(); }
+	unsigned long steals() const { return num_steals; } // tasks run by a worker other than their owner
+
+private:
+	struct Task { std::size_t first, last; };
+
+	// allocated one by one, so that workers hitting their own queue on every task share no line
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues; // one per worker, [0] is the caller's
+	std::vector<std::thread> threads;
+
+	/** Current job */
+	const Body* body = NULL;
+	std::atomic<std::size_t> remaining;
+	std::atomic<unsigned long> num_steals;
+
+	std::mutex job_mutex;
+	std::condition_variable job_start; // new job or shutdown
+	std::condition_variable job_done;
+	unsigned long generation = 0; // jobs started so far
+	bool stopping = false;
+
+	/** Methods */
+	void worker(unsigned int self);
+	bool runTask(unsigned int self); // one task, own or stolen; false when every queue is empty
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "Trajectory.h"
+
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <glm/gtc/packing.hpp>
+
+/** Namespace */
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// Command line
+//-----------------------------------------------------------------------------
+
+bool parseTrajectoryArg(int & i, int argc, char* argv[], TrajectoryOptions & options)
+{
+	string arg = argv[i];
+
+	if (arg == "--record" && i + 1 < argc)
+		options.filename = argv[++i];
+	else if (arg == "--record-every" && i + 1 < argc)
+		options.every = std::max(1ul, stoul(argv[++i]));
+	else if (arg == "--record-half")
+		options.half = true;
+	else if (arg == "--record-queue" && i + 1 < argc)
+		options.queue_depth = std::max(1ul, stoul(argv[++i]));
+	else
+		return false;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Open the file and start the writer thread
+//-----------------------------------------------------------------------------
+
+TrajectoryWriter::TrajectoryWriter(const TrajectoryOptions & options, const FluidConfig & config) :
+	options(options),
+	count(config.num_particles),
+	file(options.filename, std::ios::out | std::ios::binary),
+	frames(options.queue_depth)
+{
+	if (!file) { cerr << "Cannot open trajectory file: " << options.filename << "\n"; failed = true; return; }
+
+	// the only access to the file from this thread, before the writer starts
+	writeHeader(config);
+	if (!file) { cerr << "Trajectory write failed: " << options.filename << "\n"; failed = true; return; }
+
+	// buffers are sized once, record() only copies into them
+	for (Frame & frame : frames) {
+		frame.positions.resize(count);
+		frame.velocities.resize(count);
+		free_frames.push_back(&frame);
+	}
+
+	writer = std::thread(&TrajectoryWriter::writeLoop, this);
+}
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+	if (writer.joinable()) {
+		{
+			lock_guard<mutex> lock(queue_mutex);
+			closing = true;
+		}
+		frame_pending.notify_one();
+		writer.join();
+	}
+}
+
+template <typename T>
+static void writeValue(ofstream & file, T value)
+{
+	file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void TrajectoryWriter::writeHeader(const FluidConfig & config)
+{
+	file.write("PBFTRAJ", 8);
+	writeValue<uint32_t>(file, TRAJECTORY_VERSION);
+	writeValue<uint32_t>(file, count);
+	writeValue<uint32_t>(file, options.half ? TRAJECTORY_HALF : 0);
+	writeValue<uint32_t>(file, options.every);
+	writeValue<float>(file, config.delta_time * options.every);
+	writeValue<float>(file, config.bb_min.x);
+	writeValue<float>(file, config.bb_min.y);
+	writeValue<float>(file, config.bb_min.z);
+	writeValue<float>(file, config.bb_max.x);
+	writeValue<float>(file, config.bb_max.y);
+	writeValue<float>(file, config.bb_max.z);
+}
+
+//-----------------------------------------------------------------------------
+// Solver thread: copy a frame into a free buffer and hand it to the writer
+//-----------------------------------------------------------------------------
+
+void TrajectoryWriter::record(unsigned long step, const vector<glm::vec4> & positions, const vector<glm::vec4> & velocities)
+{
+	if (!writer.joinable()) return;
+
+	Frame* frame;
+	{
+		unique_lock<mutex> lock(queue_mutex);
+		if (free_frames.empty()) {
+			num_stalls++;
+			frame_freed.wait(lock, [this] { return !free_frames.empty(); });
+		}
+		frame = free_frames.front();
+		free_frames.pop_front();
+	}
+
+	// the frame is owned by this thread until queued
+	frame->step = step;
+	std::copy(positions.begin(), positions.begin() + count, frame->positions.begin());
+	std::copy(velocities.begin(), velocities.begin() + count, frame->velocities.begin());
+
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		pending.push_back(frame);
+	}
+	frame_pending.notify_one();
+}
+
+//-----------------------------------------------------------------------------
+// Writer thread: write pending frames in order until closed and drained
+//-----------------------------------------------------------------------------
+
+void TrajectoryWriter::writeLoop()
+{
+	for (;;) {
+		Frame* frame;
+		{
+			unique_lock<mutex> lock(queue_mutex);
+			frame_pending.wait(lock, [this] { return closing || !pending.empty(); });
+			if (pending.empty()) break;
+			frame = pending.front();
+			pending.pop_front();
+		}
+
+		writeFrame(*frame);
+
+		{
+			lock_guard<mutex> lock(queue_mutex);
+			free_frames.push_back(frame);
+		}
+		frame_freed.notify_one();
+	}
+
+	file.flush();
+	if (!file) failed = true;
+	if (failed) cerr << "Trajectory write failed: " << options.filename << "\n";
+}
+
+void TrajectoryWriter::writeFrame(const Frame & frame)
+{
+	// pack xyz of both fields into one payload, quantized on this thread
+	std::size_t component_size = options.half ? sizeof(uint16_t) : sizeof(float);
+	payload.resize(2 * 3 * count * component_size);
+
+	char* out = &payload[0];
+	for (const vector<glm::vec4>* field : { &frame.positions, &frame.velocities }) {
+		for (const glm::vec4 & v : *field) {
+			for (int c = 0; c < 3; c++) {
+				if (options.half) {
+					uint16_t h = glm::packHalf1x16(v[c]);
+					memcpy(out, &h, sizeof(h));
+				}
+				else {
+					memcpy(out, &v[c], sizeof(float));
+				}
+				out += component_size;
+			}
+		}
+	}
+
+	file.write("FRAM", 4);
+	writeValue<uint32_t>(file, (uint32_t) component_size);
+	writeValue<uint64_t>(file, frame.step);
+	file.write(&payload[0], payload.size());
+	file.flush();
+	if (!file) { failed = true; return; }
+
+	frames_written++;
+}
@@ -0,0 +1,97 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include <glm/glm.hpp>
+
+#include "Fluid.h"
+
+/** Trajectory file, little-endian:
+ *  header  "PBFTRAJ" 0, version, count, flags, every (uint32), dt (float32, time between
+ *          recorded frames), bounds min xyz, max xyz (float32)
+ *  frames  "FRAM", components size in bytes (uint32), step (uint64), then count positions
+ *          xyz followed by count velocities xyz, float32 or float16 (TRAJECTORY_HALF flag)
+ */
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_HALF 1
+
+// Recording options of the trajectory writer, given on the command line
+struct TrajectoryOptions
+{
+	std::string filename; // empty = no recording
+	unsigned int every = 1; // record every Nth frame
+	bool half = false; // quantize to float16
+	unsigned int queue_depth = 4; // frames buffered ahead of the disk
+};
+
+// Parse --record <file>, --record-every <N>, --record-half and --record-queue at argv[i];
+// returns false when argv[i] is none of them, else leaves i on the last argument consumed
+bool parseTrajectoryArg(int & i, int argc, char* argv[], TrajectoryOptions & options);
+
+// Streams frames to a trajectory file from a writer thread. record() copies the particles
+// into a free frame buffer and returns; it only blocks once queue_depth frames wait for the disk.
+class TrajectoryWriter {
+
+public:
+	/** Methods */
+	TrajectoryWriter(const TrajectoryOptions & options, const FluidConfig & config);
+	~TrajectoryWriter(); // drains the queue and closes the file
+
+	TrajectoryWriter(const TrajectoryWriter &) = delete;
+	TrajectoryWriter & operator = (const TrajectoryWriter &) = delete;
+
+	// false once opening or a write failed; the writer thread owns the stream, this reads its flag
+	bool good() const { return !failed; }
+
+	// Whether frame is kept under every-Nth-frame decimation; read the particles back only then
+	bool wants(unsigned long frame) const { return good() && frame % options.every == 0; }
+
+	// Queue the particles of one frame, read back at step
+	void record(unsigned long step, const std::vector<glm::vec4> & positions, const std::vector<glm::vec4> & velocities);
+
+	unsigned long framesWritten() const { return frames_written; }
+	unsigned long stalls() const { return num_stalls; } // record() calls that waited on the disk
+
+private:
+	struct Frame
+	{
+		unsigned long step;
+		std::vector<glm::vec4> positions;
+		std::vector<glm::vec4> velocities;
+	};
+
+	TrajectoryOptions options;
+	unsigned int count;
+	std::ofstream file;
+
+	/** Frames cycle from free to pending (solver thread) and back (writer thread) */
+	std::vector<Frame> frames;
+	std::deque<Frame*> free_frames;
+	std::deque<Frame*> pending;
+	std::mutex queue_mutex;
+	std::condition_variable frame_freed;
+	std::condition_variable frame_pending;
+	bool closing = false;
+	std::thread writer;
+
+	std::atomic<unsigned long> frames_written{0};
+	std::atomic<bool> failed{false}; // stream state, set by whichever thread owns the file at the time
+	unsigned long num_stalls = 0;
+
+	std::vector<char> payload; // packed components of the frame being written
+
+	/** Methods */
+	void writeHeader(const FluidConfig & config);
+	void writeLoop();
+	void writeFrame(const Frame & frame);
+};
+
+#endif
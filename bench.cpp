@@ -0,0 +1,154 @@
+#include "bench.h"
+
+/** OpenCL Global */
+CLInfo clInfo;
+
+//-----------------------------------------------------------------------------
+// Bench Entry Point: time each solver stage alone over synthetic particles
+//   fluid_bench.exe [options] [--device cpu|gpu] [--counts n,...]
+//                   [--distributions uniform,column,splash] [--repeat R] [--out file.csv]
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+
+	// Domain, grid and physics from command line / scene file, as in the viewer
+	FluidConfig config;
+	config.tuned = false; // time the defaults, not the tuning of the machine at hand
+	int argi = parseArgs(argc, argv, config);
+
+	cl_device_type device_type = CL_DEVICE_TYPE_CPU;
+	std::vector<std::string> counts = { "1000", "10000", "100000", "1000000" };
+	std::vector<std::string> distributions = { "uniform", "column", "splash" };
+	unsigned int repeat = 20;
+	std::string out_file;
+
+	for (; argi < argc; argi++) {
+
+		std::string arg = argv[argi];
+
+		if (arg == "--device" && argi + 1 < argc)
+			device_type = std::string(argv[++argi]) == "gpu" ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
+		else if (arg == "--counts" && argi + 1 < argc)
+			counts = splitList(argv[++argi]);
+		else if (arg == "--distributions" && argi + 1 < argc)
+			distributions = splitList(argv[++argi]);
+		else if (arg == "--repeat" && argi + 1 < argc)
+			repeat = std::max(1ul, std::stoul(argv[++argi]));
+		else if (arg == "--out" && argi + 1 < argc)
+			out_file = argv[++argi];
+		else {
+			std::cerr << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+
+	initOpenCL(clInfo.device, clInfo.context, clInfo.queue, device_type, CL_QUEUE_PROFILING_ENABLE);
+	std::string device_name = clInfo.device.getInfo<CL_DEVICE_NAME>().c_str();
+
+	std::ofstream out_stream;
+	if (!out_file.empty()) {
+		out_stream.open(out_file, std::ios::out | std::ios::trunc);
+		if (!out_stream) { std::cerr << "Cannot write results: " << out_file << "\n"; return 1; }
+	}
+	std::ostream & out = out_file.empty() ? std::cout : out_stream;
+
+	// one row per run, kernel time from profiling events
+	out << "device,distribution,particles,stage,repeat,min_ms,median_ms,avg_ms\n";
+
+	for (const std::string & distribution : distributions) {
+		for (const std::string & count : counts) {
+
+			config.num_particles = std::stoul(count);
+			Fluid fluid(clInfo, config);
+
+			std::vector<glm::vec4> positions, velocities;
+			makeParticles(distribution, config, positions, velocities);
+
+			for (int stage = 0; stage < NUM_STAGES; stage++) {
+
+				std::vector<double> samples;
+				for (unsigned int r = 0; r < repeat; r++) {
+
+					// every run starts from the same state, one full step in: cells binned, lambdas set.
+					// Stages move particles or rewrite the cells, so repeats would otherwise time drifted state
+					if (distribution == "column") fluid.initParticles();
+					else fluid.setParticles(positions, velocities);
+					fluid.simulate();
+
+					// drops the step above from the timings
+					fluid.profiler.reset();
+					fluid.enqueueStage((SolverStage) stage);
+					fluid.profiler.collect();
+
+					double ms = 0.0;
+					for (double kernel_ms : fluid.profiler.kernelTotals()) ms += kernel_ms;
+					samples.push_back(ms);
+				}
+
+				std::sort(samples.begin(), samples.end());
+				double sum = 0.0;
+				for (double ms : samples) sum += ms;
+
+				out << device_name << "," << distribution << "," << config.num_particles << "," << stageName((SolverStage) stage) << ","
+					<< repeat << "," << samples.front() << "," << samples[samples.size() / 2] << "," << sum / samples.size() << "\n";
+			}
+			out.flush();
+		}
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Synthetic particles inside the bound box, same seed every run:
+//   uniform  spread over the whole box
+//   column   the viewer's initial lattice column (Fluid::initParticles)
+//   splash   a thin pool on the floor and sparse droplets thrown up from it
+//-----------------------------------------------------------------------------
+
+void makeParticles(const std::string & distribution, const FluidConfig & config,
+	std::vector<glm::vec4> & positions, std::vector<glm::vec4> & velocities) {
+
+	unsigned int cnt_obj = config.num_particles;
+	positions.assign(cnt_obj, glm::vec4(0.0f));
+	velocities.assign(cnt_obj, glm::vec4(0.0f));
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	glm::vec3 extent = config.bb_max - config.bb_min;
+
+	if (distribution == "column") return; // initParticles() lays it out
+
+	if (distribution != "uniform" && distribution != "splash")
+		std::cerr << "Unknown distribution " << distribution << ", using uniform\n";
+
+	for (unsigned int i = 0; i < cnt_obj; i++) {
+
+		glm::vec3 p = config.bb_min + glm::vec3(unit(rng), unit(rng), unit(rng)) * extent;
+		glm::vec3 v(0.0f);
+
+		// 9 in 10 in a pool a tenth of the height deep, the rest flying upwards
+		if (distribution == "splash") {
+			if (i % 10) {
+				p.y = config.bb_min.y + 0.1f * extent.y * unit(rng);
+			}
+			else {
+				p.y = config.bb_min.y + extent.y * (0.2f + 0.8f * unit(rng));
+				v = glm::vec3(unit(rng) - 0.5f, 2.0f * unit(rng), unit(rng) - 0.5f);
+			}
+		}
+
+		positions[i] = glm::vec4(p, 0.0f);
+		velocities[i] = glm::vec4(v, 0.0f);
+	}
+}
+
+std::vector<std::string> splitList(const std::string & list) {
+
+	std::vector<std::string> items;
+	std::istringstream ins(list);
+	std::string item;
+	while (std::getline(ins, item, ','))
+		if (!item.empty()) items.push_back(item);
+	return items;
+}
@@ -0,0 +1,18 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+/** OpenCL wrapper, no OpenGL */
+#include "cl.h"
+
+/** Fluid solver */
+#include "Fluid.h"
+
+// Bench
+void makeParticles(const std::string & distribution, const FluidConfig & config,
+	std::vector<glm::vec4> & positions, std::vector<glm::vec4> & velocities);
+std::vector<std::string> splitList(const std::string & list);
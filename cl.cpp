@@ -1,17 +1,19 @@
 #include "cl.h"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <sys/stat.h>
+
 /** Namespace */
 using namespace cl;
 using namespace std;
 
 //-----------------------------------------------------------------------------
-// Initialize OpenCL
+// List platforms and devices of device_type, and pick one of each
 //-----------------------------------------------------------------------------
 
-void initOpenCL(
-	Device & device,
-	Context & context,
-	CommandQueue & queue) {
+void selectDevice(Platform & platform, Device & device, cl_device_type device_type) {
 
 	// Get all available OpenCL platforms
 	vector<Platform> platforms;
@@ -21,13 +23,12 @@ void initOpenCL(
 		cout << "\t" << i+1 << ": " << platforms[i].getInfo<CL_PLATFORM_NAME>() << "\n";
 
 	// Pick a platform
-	Platform platform;
 	pickPlarform(platform, platforms);
 	cout << "\nUsing OpenCL platform: \t" << platform.getInfo<CL_PLATFORM_NAME>() << "\n";
 
 	// Get all available OpenCL devices on this platform
 	vector<Device> devices;
-	platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
+	platform.getDevices(device_type, &devices);
 	cout << "Available OpenCL devices on this platform :\n\n";
 	for (int i = 0; i < devices.size(); i++) {
 		cout << "\t" << i+1 << ": " << devices[i].getInfo<CL_DEVICE_NAME>() << "\n";
@@ -43,56 +44,160 @@ void initOpenCL(
 	cout << "\tMax global memory size: " << device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 1024 << " Kb\n";
 	cout << "\tMax local memory size: " << device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 1024 << " Kb\n";
 	cout << "\n";
+}
 
-	// Create an OpenCL context on that device.
-	// Windows specific OpenCL-OpenGL interop
-#if defined(_WIN32)
-	// Windows                                                                  
-	cl_context_properties properties[] = {
-		CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
-		CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-		CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
-		0};
-#elif defined(__APPLE__)
-	// OS X
-	#pragma OPENCL EXTENSION CL_APPLE_gl_sharing : enable                                                       
-	CGLContextObj     kCGLContext     = CGLGetCurrentContext();
-	CGLShareGroupObj  kCGLShareGroup  = CGLGetShareGroup(kCGLContext);
-	cl_context_properties properties[] = {
-		CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
-		(cl_context_properties) kCGLShareGroup,
-		0};
-#else
-	// Linux                                                                    
-	cl_context_properties properties[] = {
-		CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
-		CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
-		CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
-		0};
-#endif
+//-----------------------------------------------------------------------------
+// Initialize OpenCL on a plain context, no OpenGL needed
+// (see initOpenCLGL in clgl.h for a context sharing OpenGL objects)
+//-----------------------------------------------------------------------------
+
+void initOpenCL(
+	Device & device,
+	Context & context,
+	CommandQueue & queue,
+	cl_device_type device_type,
+	cl_command_queue_properties queue_properties) {
+
+	Platform platform;
+	selectDevice(platform, device, device_type);
 
 	// Create an OpenCL context and command queue on the device
-	context = Context(device, properties);
-	queue = CommandQueue(context, device);
+	context = Context(device);
+	queue = CommandQueue(context, device, queue_properties);
+}
+
+//-----------------------------------------------------------------------------
+// Program binary cache: binaries built before are kept in a cache directory
+// (cl_cache, or $PBF_CL_CACHE; "off" disables it), named after a hash of
+// everything the build depends on
+//-----------------------------------------------------------------------------
+
+static string readText(const string & filename)
+{
+	ifstream text_file(filename, std::ios::in | std::ios::binary);
+	return static_cast<stringstream const&>(stringstream() << text_file.rdbuf()).str();
+}
+
+// 64-bit FNV-1a
+static uint64_t hashText(const string & text)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : text) { hash ^= c; hash *= 1099511628211ull; }
+	return hash;
+}
+
+static string programCacheDir()
+{
+	const char* dir = getenv("PBF_CL_CACHE");
+	if (!dir) return "cl_cache";
+	return string(dir) == "off" ? "" : dir;
+}
+
+// Source and the local headers it includes (from the working directory, as -I.),
+// build options, device, and driver
+static string programCacheFile(CLInfo & clInfo, const string & source, const char* options)
+{
+	string dir = programCacheDir();
+	if (dir.empty()) return "";
+
+	string key = source;
+	istringstream lines(source);
+	string line;
+	while (getline(lines, line)) {
+		std::size_t open = line.find("#include \"");
+		if (open == string::npos) continue;
+		std::size_t start = open + 10, end = line.find('"', start);
+		if (end != string::npos) key += readText(line.substr(start, end - start));
+	}
+
+	key += string("\n") + (options ? options : "");
+	key += "\n" + clInfo.device.getInfo<CL_DEVICE_NAME>();
+	key += "\n" + clInfo.device.getInfo<CL_DEVICE_VERSION>();
+	key += "\n" + clInfo.device.getInfo<CL_DRIVER_VERSION>();
+
+	ostringstream filename;
+	filename << dir << "/" << std::hex << hashText(key) << ".bin";
+	return filename.str();
+}
+
+static bool loadProgramBinary(CLInfo & clInfo, const string & filename, const char* options, Program & program)
+{
+	string binary = readText(filename);
+	if (binary.empty()) return false;
+
+	Program::Binaries binaries(1, std::make_pair(binary.data(), binary.size()));
+	vector<cl_int> status;
+	cl_int result;
+	program = Program(clInfo.context, { clInfo.device }, binaries, &status, &result);
+	if (result != CL_SUCCESS || status[0] != CL_SUCCESS) return false;
+
+	// binaries still need a build, which only links them
+	return program.build({ clInfo.device }, options) == CL_SUCCESS;
+}
+
+static void saveProgramBinary(CLInfo & clInfo, const string & filename, const Program & program)
+{
+	// binaries come one per device of the program, find ours
+	vector<Device> devices = program.getInfo<CL_PROGRAM_DEVICES>();
+	vector<char*> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+	vector<std::size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+
+	for (std::size_t i = 0; i < devices.size(); i++) {
+		if (devices[i]() != clInfo.device() || !binaries[i]) continue;
+
+		mkdir(programCacheDir().c_str(), 0755);
+		// write aside and rename, so that concurrent runs never read half a binary
+		string partial = filename + ".part";
+		ofstream binary_file(partial, std::ios::out | std::ios::binary | std::ios::trunc);
+		binary_file.write(binaries[i], sizes[i]);
+		binary_file.close();
+		if (binary_file) rename(partial.c_str(), filename.c_str());
+		else remove(partial.c_str());
+	}
+
+	for (char* binary : binaries) delete[] binary;
 }
 
 //-----------------------------------------------------------------------------
 // Compile program
 //-----------------------------------------------------------------------------
 
-void buildProgram(CLInfo & clInfo, const char* source_filename, Program & program)
+void buildProgram(CLInfo & clInfo, const char* source_filename, Program & program, const char* options)
 {
+	// Programs already built in this context, keyed on source file and build options,
+	// so that only a changed parameter (different -D options) triggers a recompile
+	static map<string, Program> built_programs;
+	string key = string(source_filename) + "\n" + (options ? options : "");
+
+	auto cached = built_programs.find(key);
+	if (cached != built_programs.end() &&
+		cached->second.getInfo<CL_PROGRAM_CONTEXT>()() == clInfo.context()) {
+		program = cached->second;
+		return;
+	}
+
 	// Convert the OpenCL source code to a string
 	ifstream source_file(source_filename, std::ios::in);
 	if (!source_file) { cerr << "Cannot find kernel code: " << source_filename << "\n"; exit(1); }
 	const string source_string(static_cast<stringstream const&>(stringstream()<<source_file.rdbuf()).str());
 	const char* kernel_source = source_string.c_str();
 
+	// Binary built by an earlier run; a stale or rejected one falls back to the source
+	string cache_file = programCacheFile(clInfo, source_string, options);
+	if (!cache_file.empty() && loadProgramBinary(clInfo, cache_file, options, program)) {
+		built_programs[key] = program;
+		return;
+	}
+
 	// Create an OpenCL program by performing runtime compilation for the chosen device
 	program = Program(clInfo.context, kernel_source);
-	cl_int result = program.build( { clInfo.device } );
+	cl_int result = program.build( { clInfo.device }, options );
 	if (result) cout << "Error during compilation OpenCL code!\n (" << result << ")\n";
 	if (result == CL_BUILD_PROGRAM_FAILURE) { printErrorLog(program, clInfo.device); exit(1); }
+
+	if (!cache_file.empty() && result == CL_SUCCESS) saveProgramBinary(clInfo, cache_file, program);
+
+	built_programs[key] = program;
 }
 
 //-----------------------------------------------------------------------------
@@ -113,6 +218,24 @@ void buildKernel(CLInfo & clInfo, Program & program, const char* func_entry_name
 	kernel = cl::Kernel(program, func_entry_name);
 }
 
+//-----------------------------------------------------------------------------
+// Enqueue kernel over work_items work items, in work-groups of local_work_size.
+// Callers pick and keep the size per kernel (Fluid::group_sizes), so launches
+// make no device queries. Returns without waiting: the in-order
+// queue runs launches in the order they are enqueued, and event, when given,
+// signals completion of this one.
+//-----------------------------------------------------------------------------
+
+void runKernel(Kernel & kernel, CLInfo & clInfo, std::size_t work_items, std::size_t local_work_size, cl::Event* event)
+{
+	std::size_t global_work_size = work_items;
+	// Ensure the global work size is a multiple of local work size
+	if (global_work_size % local_work_size != 0)
+		global_work_size = (global_work_size / local_work_size + 1) * local_work_size;
+
+	clInfo.queue.enqueueNDRangeKernel(kernel, cl::NullRange, global_work_size, local_work_size, NULL, event);
+}
+
 //-----------------------------------------------------------------------------
 // Detect and select a platform as host in OpenCL
 //-----------------------------------------------------------------------------
@@ -5,9 +5,9 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <map>
 #include <memory>
 
-#include <OpenGL/OpenGL.h> // OpenCL-OpenGL interop
 #include <OpenCL/opencl.h>
 
 /** OpenCL C++ Wrapper */
@@ -24,14 +24,18 @@ struct CLInfo
 
 void pickPlarform(cl::Platform& platform, const std::vector<cl::Platform>& platforms);
 void pickDevice(cl::Device& device, const std::vector<cl::Device>& devices);
+void selectDevice(cl::Platform& platform, cl::Device& device, cl_device_type device_type);
 void printErrorLog(const cl::Program& program, const cl::Device& device);
-void buildProgram(CLInfo & clInfo, const char* source_filename, cl::Program & program);
+void buildProgram(CLInfo & clInfo, const char* source_filename, cl::Program & program, const char* options = NULL);
 void buildKernel(CLInfo & clInfo, const char* source_filename, const char* func_entry_name, cl::Kernel & kernel);
 void buildKernel(CLInfo & clInfo, cl::Program & program, const char* func_entry_name, cl::Kernel & kernel);
+void runKernel(cl::Kernel & kernel, CLInfo & clInfo, std::size_t work_items, std::size_t local_work_size, cl::Event* event = NULL);
 
 void initOpenCL(
 	cl::Device & device,
 	cl::Context & context,
-	cl::CommandQueue & queue);
+	cl::CommandQueue & queue,
+	cl_device_type device_type = CL_DEVICE_TYPE_GPU,
+	cl_command_queue_properties queue_properties = 0);
 
 #endif
\ No newline at end of file
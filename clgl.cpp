@@ -0,0 +1,59 @@
+#include "clgl.h"
+
+#if defined(__APPLE__)
+#include <OpenGL/OpenGL.h> // CGL share group
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <GL/glx.h>
+#endif
+
+/** Namespace */
+using namespace cl;
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// Initialize OpenCL on a context shared with OpenGL
+//-----------------------------------------------------------------------------
+
+void initOpenCLGL(
+	Device & device,
+	Context & context,
+	CommandQueue & queue,
+	cl_command_queue_properties queue_properties) {
+
+	Platform platform;
+	selectDevice(platform, device, CL_DEVICE_TYPE_GPU);
+
+	// Create an OpenCL context on that device.
+	// Windows specific OpenCL-OpenGL interop
+#if defined(_WIN32)
+	// Windows                                                                  
+	cl_context_properties properties[] = {
+		CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
+		CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+		CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+		0};
+#elif defined(__APPLE__)
+	// OS X
+	#pragma OPENCL EXTENSION CL_APPLE_gl_sharing : enable                                                       
+	CGLContextObj     kCGLContext     = CGLGetCurrentContext();
+	CGLShareGroupObj  kCGLShareGroup  = CGLGetShareGroup(kCGLContext);
+	cl_context_properties properties[] = {
+		CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
+		(cl_context_properties) kCGLShareGroup,
+		0};
+#else
+	// Linux                                                                    
+	cl_context_properties properties[] = {
+		CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
+		CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
+		CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+		0};
+#endif
+
+
+	// Create an OpenCL context and command queue on the device
+	context = Context(device, properties);
+	queue = CommandQueue(context, device, queue_properties);
+}
@@ -0,0 +1,16 @@
+#ifndef CLGL_WRAPPER_H
+#define CLGL_WRAPPER_H
+
+/** clgl.h: OpenCL context sharing objects with the current OpenGL context, kept apart from cl.h
+ *  so that programs without a window (fluid_headless) link no OpenGL at all */
+
+#include "cl.h"
+
+// Pick a GPU device and create a context sharing the OpenGL context current on this thread
+void initOpenCLGL(
+	cl::Device & device,
+	cl::Context & context,
+	cl::CommandQueue & queue,
+	cl_command_queue_properties queue_properties = 0);
+
+#endif
@@ -0,0 +1,139 @@
+#include "compare.h"
+
+/** OpenCL Global */
+CLInfo clInfo;
+
+//-----------------------------------------------------------------------------
+// Compare Entry Point: run the OpenCL solver (or the native one, with --backend
+// native) and the scalar reference side by side from the same particles, and
+// report how far apart they drift
+//   fluid_compare.exe [options] [--steps N] [--every N] [--device cpu|gpu]
+//                     [--tolerance distance]
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+
+	// Particle count, domain, grid and physics from command line / scene file, as in the viewer
+	FluidConfig config;
+	int argi = parseArgs(argc, argv, config);
+
+	unsigned long num_steps = 100;
+	unsigned long report_every = 10;
+	cl_device_type device_type = CL_DEVICE_TYPE_CPU;
+	float tolerance = 0.0f; // 0: report only
+
+	for (; argi < argc; argi++) {
+
+		std::string arg = argv[argi];
+
+		if (arg == "--steps" && argi + 1 < argc)
+			num_steps = std::stoul(argv[++argi]);
+		else if (arg == "--every" && argi + 1 < argc)
+			report_every = std::max(1ul, std::stoul(argv[++argi]));
+		else if (arg == "--device" && argi + 1 < argc)
+			device_type = std::string(argv[++argi]) == "gpu" ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
+		else if (arg == "--tolerance" && argi + 1 < argc)
+			tolerance = std::stof(argv[++argi]);
+		else {
+			std::cerr << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+
+	std::unique_ptr<Solver> solver;
+	std::string backend;
+
+	if (config.native) {
+		NativeSolver* native = new NativeSolver(config);
+		solver.reset(native);
+		backend = "native";
+		std::cout << config.num_particles << " particles on " << native->threads() << " threads\n\n";
+	}
+	else {
+		initOpenCL(clInfo.device, clInfo.context, clInfo.queue, device_type);
+		solver.reset(new Fluid(clInfo, config));
+		backend = "OpenCL";
+		std::cout << config.num_particles << " particles on " << clInfo.device.getInfo<CL_DEVICE_NAME>().c_str() << "\n\n";
+	}
+
+	solver->initParticles();
+	solver->readParticles();
+
+	// the reference starts from the solver's particles, checkpoint included
+	ReferenceSolver reference(config);
+	reference.setParticles(solver->positions, solver->velocities);
+
+	std::cout << std::setw(8) << "step"
+		<< std::setw(14) << "max_pos" << std::setw(14) << "rms_pos"
+		<< std::setw(14) << "max_lambda" << std::setw(14) << "rms_lambda" << "\n";
+
+	// the first step pays for lazy allocation on the device, keep it out of the timings
+	double solver_seconds = 0.0;
+	double reference_seconds = 0.0;
+	float worst = 0.0f;
+
+	for (unsigned long step = 1; step <= num_steps; step++) {
+
+		auto start = std::chrono::steady_clock::now();
+		solver->simulate();
+		solver->finish();
+		auto middle = std::chrono::steady_clock::now();
+		reference.simulate();
+		auto stop = std::chrono::steady_clock::now();
+
+		if (step > 1) {
+			solver_seconds += std::chrono::duration<double>(middle - start).count();
+			reference_seconds += std::chrono::duration<double>(stop - middle).count();
+		}
+
+		if (step % report_every == 0 || step == num_steps) {
+			Divergence diff = divergence(*solver, reference);
+			worst = std::max(worst, diff.max_position);
+			std::cout << std::setw(8) << step
+				<< std::setw(14) << diff.max_position << std::setw(14) << diff.rms_position
+				<< std::setw(14) << diff.max_lambda << std::setw(14) << diff.rms_lambda << "\n";
+		}
+	}
+
+	if (num_steps > 1) {
+		double timed = num_steps - 1;
+		std::cout << "\n" << std::left << std::setw(11) << (backend + ":") << 1000.0 * solver_seconds / timed << " ms/step\n";
+		std::cout << std::setw(11) << "reference:" << 1000.0 * reference_seconds / timed << " ms/step\n";
+		std::cout << std::setw(11) << "ratio:" << reference_seconds / solver_seconds << "x (reference / " << backend << ")\n";
+	}
+
+	if (tolerance > 0.0f && worst > tolerance) {
+		std::cout << "max position divergence " << worst << " exceeds tolerance " << tolerance << "\n";
+		return 1;
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Position and lambda differences between two solvers, particle by particle
+//-----------------------------------------------------------------------------
+
+Divergence divergence(Solver & solver, Solver & reference) {
+
+	std::vector<float> lambdas, reference_lambdas;
+	solver.readLambdas(lambdas);
+	reference.readLambdas(reference_lambdas);
+
+	Divergence diff;
+	double sum_position = 0.0, sum_lambda = 0.0;
+	for (unsigned int i = 0; i < solver.size(); i++) {
+		float position = glm::distance(glm::vec3(solver.positions[i]), glm::vec3(reference.positions[i]));
+		float lambda = std::fabs(lambdas[i] - reference_lambdas[i]);
+		diff.max_position = std::max(diff.max_position, position);
+		diff.max_lambda = std::max(diff.max_lambda, lambda);
+		sum_position += position * position;
+		sum_lambda += lambda * lambda;
+	}
+
+	if (solver.size()) {
+		diff.rms_position = std::sqrt(sum_position / solver.size());
+		diff.rms_lambda = std::sqrt(sum_lambda / solver.size());
+	}
+	return diff;
+}
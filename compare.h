@@ -0,0 +1,27 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+
+/** OpenCL wrapper, no OpenGL */
+#include "cl.h"
+
+/** Fluid solvers */
+#include "Fluid.h"
+#include "ReferenceSolver.h"
+#include "NativeSolver.h"
+
+// Compare
+struct Divergence
+{
+	float max_position = 0.0f; // distance between the two copies of a particle
+	float rms_position = 0.0f;
+	float max_lambda = 0.0f;
+	float rms_lambda = 0.0f;
+};
+
+Divergence divergence(Solver & solver, Solver & reference);
@@ -0,0 +1,217 @@
+#include "headless.h"
+
+/** OpenCL Global */
+CLInfo clInfo;
+
+//-----------------------------------------------------------------------------
+// Headless Entry Point: run the solver on a plain OpenCL context, or on host
+// threads with --backend native, no window
+//   fluid_headless.exe [options] --scaling [steps] [count ...]
+//   fluid_headless.exe [options] [--steps N] [--device cpu|gpu] [--dump prefix every]
+//                      [--record file] [--record-every N] [--record-half] [--record-queue frames]
+//                      [--checkpoint file every] [--autotune steps] [--profile file.csv|file.json]
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+
+	// Particle count, domain and grid from command line / scene file
+	FluidConfig config;
+	int argi = parseArgs(argc, argv, config);
+
+	// Scaling mode: time the solver at several particle counts on a CPU OpenCL device
+	if (argi < argc && std::string(argv[argi]) == "--scaling")
+		return runScaling(config, argc - argi - 1, argv + argi + 1);
+
+	unsigned long num_steps = 1000;
+	cl_device_type device_type = CL_DEVICE_TYPE_CPU;
+	std::string dump_prefix;
+	unsigned long dump_every = 0;
+	TrajectoryOptions trajectory;
+	std::string checkpoint_file;
+	unsigned long checkpoint_every = 0;
+	unsigned int autotune_steps = 0;
+	std::string profile_file;
+
+	for (; argi < argc; argi++) {
+
+		std::string arg = argv[argi];
+
+		if (arg == "--steps" && argi + 1 < argc)
+			num_steps = std::stoul(argv[++argi]);
+		else if (arg == "--device" && argi + 1 < argc)
+			device_type = std::string(argv[++argi]) == "gpu" ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
+		else if (arg == "--dump" && argi + 2 < argc) {
+			dump_prefix = argv[++argi];
+			dump_every = std::stoul(argv[++argi]);
+		}
+		else if (arg == "--autotune" && argi + 1 < argc)
+			autotune_steps = std::stoul(argv[++argi]);
+		else if (arg == "--profile" && argi + 1 < argc)
+			profile_file = argv[++argi];
+		else if (arg == "--checkpoint" && argi + 2 < argc) {
+			checkpoint_file = argv[++argi];
+			checkpoint_every = std::stoul(argv[++argi]);
+		}
+		else if (!parseTrajectoryArg(argi, argc, argv, trajectory)) {
+			std::cerr << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+
+	// OpenCL or native solver; profiling, checkpoints and tuning are the OpenCL solver's
+	std::unique_ptr<Solver> solver;
+	Fluid* fluid = NULL;
+
+	if (config.native) {
+		if (autotune_steps || !checkpoint_file.empty() || !profile_file.empty()) {
+			std::cerr << "--autotune, --checkpoint and --profile need the OpenCL backend\n";
+			return 1;
+		}
+		NativeSolver* native = new NativeSolver(config);
+		solver.reset(native);
+		std::cout << "Native solver on " << native->threads() << " threads\n";
+	}
+	else {
+		// Kernel timestamps give the per-stage breakdown
+		initOpenCL(clInfo.device, clInfo.context, clInfo.queue, device_type, CL_QUEUE_PROFILING_ENABLE);
+
+		fluid = new Fluid(clInfo, config);
+		solver.reset(fluid);
+
+		// tune work-group sizes and kernel variant for this device and count, then quit
+		if (autotune_steps)
+			return fluid->autotune(autotune_steps) ? 0 : 1;
+	}
+
+	solver->initParticles();
+
+	std::unique_ptr<TrajectoryWriter> recorder;
+	if (!trajectory.filename.empty()) {
+		recorder.reset(new TrajectoryWriter(trajectory, config));
+		if (!recorder->good()) return 1;
+	}
+
+	if (fluid && !profile_file.empty() && !fluid->profiler.openLog(profile_file)) return 1;
+
+	// first step pays for lazy allocation on the device, keep it out of the timings
+	solver->simulate();
+	if (fluid) fluid->profiler.reset();
+
+	if (dump_every) dumpFrame(*solver, dump_prefix, 0);
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned long step = 1; step <= num_steps; step++) {
+
+		solver->simulate();
+
+		// the read back waits for the step, so only dumped steps sync with the host
+		if (dump_every && step % dump_every == 0)
+			dumpFrame(*solver, dump_prefix, step / dump_every);
+
+		// the writer thread packs and writes the frame while the solver goes on
+		if (recorder && recorder->wants(step)) {
+			if (!dump_every || step % dump_every != 0) solver->readParticles();
+			recorder->record(solver->step_count, solver->positions, solver->velocities);
+		}
+
+		// overwritten in place, so a crash loses at most checkpoint_every steps
+		if (fluid && checkpoint_every && step % checkpoint_every == 0)
+			fluid->saveCheckpoint(checkpoint_file.c_str());
+
+		// collect timestamps now and then, events would pile up over a long run
+		if (fluid && step % 256 == 0) {
+			fluid->profiler.collect(false);
+			fluid->profiler.log(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+	}
+	solver->finish();
+	auto stop = std::chrono::steady_clock::now();
+
+	double seconds = std::chrono::duration<double>(stop - start).count();
+	std::cout << "\n" << config.num_particles << " particles, " << num_steps << " steps in " << seconds << " s: "
+		<< num_steps / seconds << " steps/s\n";
+
+	if (fluid) {
+		fluid->profiler.collect();
+		fluid->profiler.report(std::cout);
+		fluid->profiler.log(seconds);
+	}
+	else {
+		std::cout << static_cast<NativeSolver &>(*solver).steals() << " tasks stolen\n";
+	}
+
+	if (fluid && !checkpoint_file.empty() && fluid->saveCheckpoint(checkpoint_file.c_str()))
+		std::cout << "checkpoint: " << checkpoint_file << " at step " << fluid->step_count << "\n";
+	if (recorder)
+		std::cout << recorder->framesWritten() << " frames written so far, " << recorder->stalls() << " waited for the disk\n";
+
+	if (recorder) {
+		recorder.reset(); // drains the queue
+		std::cout << "trajectory: " << trajectory.filename << "\n";
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Scaling mode: time the solver at large particle counts on a CPU OpenCL device
+//   fluid_headless.exe [options] --scaling [steps] [count ...]
+//-----------------------------------------------------------------------------
+
+int runScaling(FluidConfig config, int argc, char* argv[]) {
+
+	unsigned int num_steps = 10;
+	std::vector<unsigned int> counts = { 100000, 250000, 500000, 1000000 };
+
+	if (argc > 0) num_steps = std::stoul(argv[0]);
+	if (argc > 1) counts.assign(argc - 1, 0);
+	for (int i = 1; i < argc; i++) counts[i - 1] = std::stoul(argv[i]);
+
+	initOpenCL(clInfo.device, clInfo.context, clInfo.queue, CL_DEVICE_TYPE_CPU);
+
+	std::cout << "particles, steps, ms/step\n";
+
+	for (unsigned int count : counts) {
+
+		config.num_particles = count;
+		Fluid fluid(clInfo, config);
+		fluid.initParticles();
+
+		// first step pays for lazy allocation on the device
+		fluid.simulate();
+		clInfo.queue.finish();
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < num_steps; i++) fluid.simulate();
+		clInfo.queue.finish();
+		auto stop = std::chrono::steady_clock::now();
+
+		double ms = std::chrono::duration<double, std::milli>(stop - start).count();
+		std::cout << count << ", " << num_steps << ", " << ms / num_steps << "\n";
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Write particle positions and speeds of one frame to <prefix>_<frame>.xyz
+//-----------------------------------------------------------------------------
+
+void dumpFrame(Solver & fluid, const std::string & prefix, unsigned long frame) {
+
+	fluid.readParticles();
+
+	std::ostringstream filename;
+	filename << prefix << "_" << std::setw(5) << std::setfill('0') << frame << ".xyz";
+
+	std::ofstream frame_file(filename.str(), std::ios::out);
+	if (!frame_file) { std::cerr << "Cannot write frame: " << filename.str() << "\n"; return; }
+
+	// extended XYZ: count, comment line, then one particle per line
+	frame_file << fluid.size() << "\n";
+	frame_file << "step " << fluid.step_count << " dt " << fluid.config.delta_time << "\n";
+	for (unsigned int i = 0; i < fluid.size(); i++) {
+		const glm::vec4 & p = fluid.positions[i];
+		frame_file << "P " << p.x << " " << p.y << " " << p.z << " " << glm::length(glm::vec3(fluid.velocities[i])) << "\n";
+	}
+}
@@ -0,0 +1,21 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <memory>
+
+/** OpenCL wrapper, no OpenGL */
+#include "cl.h"
+
+/** Fluid solvers */
+#include "Fluid.h"
+#include "NativeSolver.h"
+
+/** Trajectory recording */
+#include "Trajectory.h"
+
+// Headless
+int runScaling(FluidConfig config, int argc, char* argv[]);
+void dumpFrame(Solver & fluid, const std::string & prefix, unsigned long frame);
@@ -6,28 +6,10 @@ const int gWindowWidth = 1280;
 const int gWindowHeight = 720;
 GLFWwindow* gWindow = NULL;
 
-// On my Mac, max local memory space is 65536 B
-// 48 * 1365 = 65520 < 65536 < 65568 = 48 * 1366
-const unsigned int cnt_obj = 1200; // particles number (<= 1365)
-const unsigned int cnt_cell = 1000;
-
 /** OpenCL Global */
-cl::Program program;
-cl::Kernel kernels[6];
 CLInfo clInfo;
 cl_int err;
 
-Particle cpuParticles[cnt_obj];
-cl::Buffer clParticles;
-
-int cpuIndices[cnt_obj];
-cl::Buffer clIndices;
-
-CellLookupTable cpuLookup[cnt_cell];
-cl::Buffer clLookup;
-
-cl::Buffer clLambdas;
-
 //std::vector<cl::Memory> clTasks;
 
 // Camera
@@ -37,7 +19,16 @@ Camera camera(glm::vec3(0.0f, 0.0f, 5.0f));
 // Main Application Entry Point
 //-----------------------------------------------------------------------------
 
-int main() {
+int main(int argc, char* argv[]) {
+
+	// Particle count, domain and grid from command line / scene file
+	FluidConfig config;
+	int argi = parseArgs(argc, argv, config);
+
+	// Per-stage device timings, printed every second and logged to a CSV or JSON file
+	std::string profile_file;
+	if (argi + 1 < argc && std::string(argv[argi]) == "--profile")
+		profile_file = argv[argi + 1];
 
 	// Init OpenGL
 	if (!initOpenGL()){
@@ -51,24 +42,12 @@ int main() {
 
 	// Init OpenCL
 	glFinish();
-	initOpenCL(clInfo.device, clInfo.context, clInfo.queue);
+	initOpenCLGL(clInfo.device, clInfo.context, clInfo.queue, profile_file.empty() ? 0 : CL_QUEUE_PROFILING_ENABLE);
 
-	// Create buffer for GPU
-	clParticles = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, cnt_obj * sizeof(Particle));
-	clIndices = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, cnt_obj * sizeof(int));
-	clLookup = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, cnt_cell * sizeof(CellLookupTable));
-	clLambdas = cl::Buffer(clInfo.context, CL_MEM_READ_WRITE, cnt_obj * sizeof(float));
-
-	// Create program for kernels
-	buildProgram(clInfo, "Particle.cl", program);
-
-	// Specify OpenCL kernel arguments (args[0] here is entry function name of GPU)
-	buildKernel(clInfo, program, "kernel_externel_force", kernels[0]);
-	buildKernel(clInfo, program, "kernel_find_cell", kernels[1]);
-	buildKernel(clInfo, program, "kernel_calc_lambda", kernels[2]);
-	buildKernel(clInfo, program, "kernel_calc_disp", kernels[3]);
-	buildKernel(clInfo, program, "kernel_update", kernels[4]);
-	buildKernel(clInfo, program, "kernel_viscosity", kernels[5]);
+	// Create program, kernels and buffers
+	Fluid fluid(clInfo, config);
+	unsigned int cnt_obj = fluid.size();
+	if (!profile_file.empty() && !fluid.profiler.openLog(profile_file)) return -1;
 
 
 
@@ -120,39 +99,48 @@ int main() {
 	instanceShader.setUniform("uSpotLight.constant", 1.0f);
 	instanceShader.setUniform("uSpotLight.linear", 0.09f);
 	instanceShader.setUniform("uSpotLight.quadratic", 0.032f);
+	// Particle size and speed color ramp
+	instanceShader.setUniform("uParticleScale", 0.02f);
+	instanceShader.setUniform("uSlowColor", 0.0f, 0.0f, 1.0f);
+	instanceShader.setUniform("uFastColor", 1.0f, 1.0f, 1.0f);
 
 
 
 	// Instancing
-	ParticleInst particleInst[cnt_obj];
+	std::vector<ParticleInst> particleInst(cnt_obj);
 
 	unsigned int ibo;
 	glGenBuffers(1, &ibo);
 	glBindBuffer(GL_ARRAY_BUFFER, ibo);
+	glBufferData(GL_ARRAY_BUFFER, cnt_obj * sizeof(ParticleInst), NULL, GL_DYNAMIC_DRAW);
+
+	// Share the instance buffer with OpenCL, so kernels fill it in place;
+	// fall back to reading particles back when the context cannot share
+	cl_int interop_err;
+	cl::BufferGL clInstances(clInfo.context, CL_MEM_WRITE_ONLY, ibo, &interop_err);
+	bool interop = interop_err == CL_SUCCESS;
+	std::vector<cl::Memory> glObjects;
+	if (interop) glObjects.push_back(clInstances);
+	else std::cerr << "OpenCL/OpenGL sharing unavailable (" << interop_err << "), reading particles back\n";
+
+	// With cl_khr_gl_event, acquire waits for pending GL commands on the buffer and release
+	// holds back later GL commands on it, both inside the drivers
+	bool glEvent = interop && clInfo.device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_gl_event") != std::string::npos;
+
+	// Read-back path streams instances through a ring of regions instead of respecifying ibo
+	std::unique_ptr<StreamBuffer> instanceStream;
+	if (!interop) instanceStream.reset(new StreamBuffer(cnt_obj * sizeof(ParticleInst)));
 
 	for (Mesh & mesh : objectParticle.meshes) {
 
 		unsigned VAO = mesh.VAO();
 		glBindVertexArray(VAO);
-		size_t vec4Size = (int) sizeof(glm::vec4);
 
+		// position and speed in one vec4
 		glEnableVertexAttribArray(3);
 		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInst), (void*)0);
 
-		glEnableVertexAttribArray(4);
-		glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInst), (void*)(1 * vec4Size));
-		glEnableVertexAttribArray(5);
-		glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInst), (void*)(2 * vec4Size));
-		glEnableVertexAttribArray(6);
-		glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInst), (void*)(3 * vec4Size));
-		glEnableVertexAttribArray(7);
-		glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInst), (void*)(4 * vec4Size));
-
 		glVertexAttribDivisor(3, 1);
-		glVertexAttribDivisor(4, 1);
-		glVertexAttribDivisor(5, 1);
-		glVertexAttribDivisor(6, 1);
-		glVertexAttribDivisor(7, 1);
 
 		glBindVertexArray(0);
 	}
@@ -160,53 +148,21 @@ int main() {
 
 
 	// Init Particle
-	for (int i = 0; i < cnt_obj; i++) {
-		//float px = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
-		//float py = 0.0f;
-		//float pz = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
-		//float vx = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
-		//float vy = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
-		//float vz = (rand() / (float) RAND_MAX) * 2.0f - 1.0f;
-		float px = -0.9f + 0.2f * (i % 10);
-		float py = -0.9f + 0.2f * (i / 100);
-		float pz = -0.9f + 0.2f * ((i / 10) % 10);
-		float vx = 0.0f;
-		float vy = 0.0f;
-		float vz = 0.0f;
-		cpuParticles[i].position = glm::vec3(px, py, pz);
-		cpuParticles[i].velocity = glm::vec3(vx, vy, vz);
-	}
-
-	clInfo.queue.enqueueWriteBuffer(clParticles, CL_TRUE, 0, cnt_obj * sizeof(Particle), cpuParticles);
-
-	//
-	kernels[0].setArg(0, clParticles);
-	//
-	kernels[1].setArg(0, clParticles);
-	kernels[1].setArg(1, clIndices);
-	//
-	kernels[2].setArg(0, clParticles);
-	kernels[2].setArg(1, clLookup);
-	kernels[2].setArg(2, clIndices);
-	kernels[2].setArg(3, clLambdas);
-	//
-	kernels[3].setArg(0, clParticles);
-	kernels[3].setArg(1, clLookup);
-	kernels[3].setArg(2, clIndices);
-	kernels[3].setArg(3, clLambdas);
-	//
-	kernels[4].setArg(0, clParticles);
-	//
-	//kernels[5].setArg(0, clParticles);
-	//kernels[5].setArg(1, clLookup);
-	//kernels[5].setArg(2, clIndices);
+	fluid.initParticles();
 
 	// Rendering loop
+	double lastTime = glfwGetTime();
+	double lastReport = lastTime;
 	while (!glfwWindowShouldClose(gWindow)) {
 
 		// Display FPS on title
 		showFPS(gWindow);
 
+		// Wall clock the fluid catches up with, in fixed steps
+		double currentTime = glfwGetTime();
+		double elapsed = currentTime - lastTime;
+		lastTime = currentTime;
+
 		// Key input
 		processInput(gWindow);
 
@@ -217,92 +173,52 @@ int main() {
 
 		////////// Fluid calculation //////////
 
-		// apply external force
-		runKernel(kernels[0], clInfo);
-
-		// find particles' neighbors
-		runKernel(kernels[1], clInfo);
-
-		clInfo.queue.enqueueReadBuffer(clIndices, CL_TRUE, 0, cnt_obj * sizeof(int), cpuIndices);
-
-		std::map<int, std::vector<int> > cell_particle_table; // not radix-sorting yet
-		for (int i = 0; i < cnt_obj; i++)
-		{
-			//std::cout<<i<<" "<<cpuIndices[i]<<"\n";
-			cell_particle_table[cpuIndices[i]].push_back(i);
-		}
-
-		int cnt_particle = 0;
-		for (auto iter = cell_particle_table.begin(); iter != cell_particle_table.end(); iter++)
-		{
-			//std::cout<<iter->first<<" "<<cnt_particle<<" "<<iter->second.size()<<"\n";
-			cpuLookup[iter->first].offset = cnt_particle;
-			cpuLookup[iter->first].size = iter->second.size(); // number of particles in current cell
-
-			for (int p_id : iter->second)
-			{
-				cpuIndices[cnt_particle++] = p_id; // particle ID
-			}
-		}
-
-		//for (int i=0; i<cnt_cell; i++)
-		//{
-		//	if (cpuLookup[i].size == 0) continue;
-		//	std::cout<<i<<" "<<cpuLookup[i].offset<<" "<<cpuLookup[i].size<<" : ";
-		//	for (int j=0; j<cpuLookup[i].size; j++)
-		//	{
-		//		std::cout<<cpuIndices[cpuLookup[i].offset + j]<<" ";
-		//	} std::cout<<"\n";
-		//}
-
-		clInfo.queue.enqueueWriteBuffer(clIndices, CL_TRUE, 0, cnt_obj * sizeof(int), cpuIndices);
-		clInfo.queue.enqueueWriteBuffer(clLookup, CL_TRUE, 0, cnt_cell * sizeof(CellLookupTable), cpuLookup);
-
-		// solve constrain equation
-		unsigned int num_iteration = 5;
-		for (int i = 0; i < num_iteration; ++i)
-		{
-			// calculate lambda
-			runKernel(kernels[2], clInfo);
-
-			// calculate displacement
-			runKernel(kernels[3], clInfo);
+		if (interop) {
+
+			// GL must be done with the instance buffer before OpenCL acquires it. Without
+			// cl_khr_gl_event, glFinish is the only way the sharing spec offers to be sure
+			if (glEvent) glFlush();
+			else glFinish();
+			clInfo.queue.enqueueAcquireGLObjects(&glObjects, NULL, fluid.profiler.tag("gl_acquire"));
+
+			// instances of the last steps, then the next steps compute while they are drawn
+			cl::Event released;
+			fluid.fillInstances(clInstances, fluid.blend());
+			clInfo.queue.enqueueReleaseGLObjects(&glObjects, NULL, &released);
+			fluid.profiler.record("gl_release", released);
+			fluid.advance(elapsed);
+			clInfo.queue.flush();
+
+			// GL draws from the buffer next. Without cl_khr_gl_event GL cannot wait on an OpenCL
+			// event, so the host waits for the release or GL may draw a half-written buffer.
+			// The steps enqueued after the release keep computing meanwhile
+			if (!glEvent) released.wait();
 		}
+		else {
 
-		// update particle
-		runKernel(kernels[4], clInfo);
+			// draw the steps read back last frame while this frame's compute and copy
+			fluid.advance(elapsed);
 
-		// confining fluid
-		//runKernel(kernels[5], clInfo);
+			fluid.readParticlesAsync();
 
-		clInfo.queue.enqueueReadBuffer(clParticles, CL_TRUE, 0, cnt_obj * sizeof(Particle), cpuParticles);
 
 
+			for (unsigned int i=0; i<cnt_obj; i++) {
+				particleInst[i].position = glm::mix(glm::vec3(fluid.prev_positions[i]), glm::vec3(fluid.positions[i]), fluid.alpha);
+				particleInst[i].speed = glm::length(glm::vec3(fluid.velocities[i]));
+			}
 
-		for (unsigned int i=0; i<cnt_obj; i++) {
-
-			// transformation
-
-			glm::mat4 matrix;
-
-			float rx = cpuParticles[i].position.x;
-			float ry = cpuParticles[i].position.y;
-			float rz = cpuParticles[i].position.z;
-
-			matrix = glm::translate(matrix, glm::vec3(rx, ry, rz));
-			matrix = glm::scale(matrix, glm::vec3(0.02f));
-
-			particleInst[i].matrix = matrix;
-
-			// speed discriminator
+			GLintptr offset = instanceStream->Write(&particleInst[0], cnt_obj * sizeof(ParticleInst));
 
-			float speed = glm::length(cpuParticles[i].velocity);
-			speed = 1.0f - std::exp(-speed);
-			particleInst[i].color = glm::vec4(speed, speed, 1.0f, 1.0f);
+			// point the instance attribute at the region just written
+			glBindBuffer(GL_ARRAY_BUFFER, instanceStream->Buffer());
+			for (Mesh & mesh : objectParticle.meshes) {
+				glBindVertexArray(mesh.VAO());
+				glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInst), (void*)offset);
+			}
+			glBindVertexArray(0);
 		}
 
-		glBufferData(GL_ARRAY_BUFFER, cnt_obj * sizeof(ParticleInst), &particleInst[0], GL_STATIC_DRAW);
-
 
 
 		// Camera transformations
@@ -347,6 +263,16 @@ int main() {
 
 
 
+		// rolling per-stage timings of the commands complete so far, without waiting
+		if (fluid.profiler.enabled && currentTime - lastReport >= 1.0) {
+			fluid.profiler.collect(false);
+			fluid.profiler.report(std::cout);
+			fluid.profiler.log(currentTime);
+			lastReport = currentTime;
+		}
+
+
+
 		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
 		glfwPollEvents();
 		glfwSwapBuffers(gWindow);
@@ -359,27 +285,6 @@ int main() {
 
 
 
-//-----------------------------------------------------------------------------
-// execute kernel
-//-----------------------------------------------------------------------------
-
-void runKernel(cl::Kernel & kernel, CLInfo & clInfo) {
-
-	// Every pixel in the image has its own thread or "work item",
-	// so #work_items == #pixel
-	std::size_t global_work_size = cnt_obj;
-	std::size_t local_work_size = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clInfo.device);
-	// Ensure the global work size is a multiple of local work size
-	if (global_work_size % local_work_size != 0)
-		global_work_size = (global_work_size / local_work_size + 1) * local_work_size;
-
-	glFinish();
-	clInfo.queue.enqueueNDRangeKernel(kernel, cl::NullRange, global_work_size, local_work_size);
-	clInfo.queue.finish();
-}
-
-
-
 //-----------------------------------------------------------------------------
 // Initialize GLFW and OpenGL
 //-----------------------------------------------------------------------------
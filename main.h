@@ -1,7 +1,10 @@
 #include <iostream>
 #include <sstream>
 #include <string>
-#include <map>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
 
 /** Basic GLFW header */
 #include <glad/glad.h> // Important - this header must come before glfw3 header
@@ -17,7 +20,7 @@
 
 /** OpenCL wrapper */
 #include <OpenGL/OpenGL.h>
-#include "cl.h"
+#include "clgl.h"
 
 /** Shader Wrapper */
 #include <Shader.h>
@@ -28,30 +31,24 @@
 /** Model Wrapper */
 #include <Model.h>
 
-//////////////////// Particle ////////////////////
+/** Streaming buffer for per-frame uploads */
+#include <StreamBuffer.h>
 
-// particle OpenCL IO
-struct Particle
-{
-	glm::vec3 position;
-	glm::vec3 velocity;
-	glm::vec3 predicted_pos;
-} __attribute__ ((aligned (16)));
+/** Fluid solver */
+#include "Fluid.h"
 
-// for rapid mapping cell IDs table to particles table
-struct CellLookupTable
-{
-	int offset;
-	int size;
-};
+//////////////////// Particle ////////////////////
 
-// for instancing in OpenGL
+// for instancing in OpenGL; scale and speed color are applied in instancing.vert
 struct ParticleInst
 {
-	glm::vec4 color;
-	glm::mat4 matrix;
+	glm::vec3 position;
+	float speed;
 };
 
+// kernel_fill_instances writes one float4 per instance
+static_assert(sizeof(ParticleInst) == sizeof(cl_float4), "ParticleInst must match kernel_fill_instances");
+
 // OpenGL
 void processInput(GLFWwindow* window);
 void mouseCallback(GLFWwindow* window, double xpos, double ypos);
@@ -59,7 +56,3 @@ void scrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void glfw_onFramebufferSize(GLFWwindow* window, int width, int height);
 void showFPS(GLFWwindow* window);
 bool initOpenGL();
-
-// OpenCL
-//void initKernel(cl::Kernel & kernel, cl::Program & program, const char* kernel_func_name);
-void runKernel(cl::Kernel & kernel, CLInfo & clInfo);
@@ -3,8 +3,7 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
-layout (location = 3) in vec4 instSpeedColor;
-layout (location = 4) in mat4 instMatrix; // instance buffer
+layout (location = 3) in vec4 instPosSpeed; // instance buffer: position in xyz, speed in w
 
 out vec3 FragPos;
 out vec3 Normal;
@@ -15,18 +14,22 @@ uniform mat4 uModel; // useless in this case
 uniform mat4 uView;
 uniform mat4 uProjection;
 
+uniform float uParticleScale; // sphere model to particle size
+uniform vec3 uSlowColor; // speed discriminator ramp, at rest
+uniform vec3 uFastColor; // and toward high speed
+
 void main() {
 
-	gl_Position = uProjection * uView * instMatrix * vec4(aPos, 1.0f);
+	// Get one fragment's position in World Space (uniform scale, then translate)
+	FragPos = instPosSpeed.xyz + uParticleScale * aPos;
 
-	// Get one fragment's position in World Space
-	FragPos = vec3(instMatrix * vec4(aPos, 1.0));
+	gl_Position = uProjection * uView * vec4(FragPos, 1.0);
 
-	// Also don't forget to transform normal vector
-	Normal = mat3(transpose(inverse(instMatrix))) * aNormal;
-	//Normal = mat3(instMatrix) * aNormal;
+	// A uniform scale and a translation leave normals unchanged
+	Normal = aNormal;
 
 	TexCoords = aTexCoords;
 
-	SpeedColor = instSpeedColor;
+	float speed = 1.0 - exp(-instPosSpeed.w);
+	SpeedColor = vec4(mix(uSlowColor, uFastColor, speed), 1.0);
 }
\ No newline at end of file